@@ -0,0 +1,223 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_BARNESHUTTREE_H
+#define PARTICLES_PLUGIN_BARNESHUTTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Vec.h"
+
+/** Quadtree for approximating the pairwise attraction between many bodies in O(N log N) (Barnes-Hut)
+ *  The tree is thrown away and rebuilt every step, so all of its nodes come from an arena which is sized once at
+ *  construction. If the arena ever runs out (or bodies are stacked on top of each other) the remaining bodies are
+ *  kept in a list on the deepest leaf they reach. That costs a little time, since those bodies are summed one at a
+ *  time, but never allocates and never changes the answer.
+ */
+class BarnesHutTree {
+private:
+    static constexpr int EMPTY = -1;
+    static constexpr int MAX_DEPTH = 24;
+
+    struct Node {
+        Vec centre;
+        double halfSize;
+        double mass;
+        // Sum of mass * position, divided through by mass when the centre of mass is needed
+        Vec weightedPosition;
+        // Children are always allocated as a block of four, so only the first index is stored
+        int firstChild;
+        // For a leaf, the first of the bodies in it (see nextBody), or EMPTY
+        int body;
+    };
+
+    std::vector<Node> nodes;
+    int nodeCount = 0;
+    double openingAngle = 0.5;
+
+    // Everything the tree needs to know about each body, by index. A body that isn't in the tree has no mass
+    std::vector<Vec> bodyPositions;
+    std::vector<double> bodyMasses;
+    // The next body in the same leaf, or EMPTY
+    std::vector<int> nextBody;
+
+    void initNode(int index, Vec centre, double halfSize) {
+        nodes[index] = {centre, halfSize, 0.0, {0, 0}, EMPTY, EMPTY};
+    }
+
+    static int quadrantFor(const Node &node, const Vec &pos) {
+        return (pos.x >= node.centre.x ? 1 : 0) + (pos.y >= node.centre.y ? 2 : 0);
+    }
+
+    void split(int index) {
+        auto firstChild = nodeCount;
+        nodeCount += 4;
+        auto &node = nodes[index];
+        auto quarter = node.halfSize / 2;
+        for (auto q = 0; q < 4; q++) {
+            Vec offset = {(q & 1) ? quarter : -quarter, (q & 2) ? quarter : -quarter};
+            initNode(firstChild + q, node.centre + offset, quarter);
+        }
+        nodes[index].firstChild = firstChild;
+    }
+
+    void insert(int body) {
+        const auto &pos = bodyPositions[body];
+        const auto mass = bodyMasses[body];
+        nextBody[body] = EMPTY;
+        auto index = 0;
+        for (auto depth = 0;; depth++) {
+            auto &node = nodes[index];
+            node.mass += mass;
+            node.weightedPosition += mass * pos;
+
+            if (node.firstChild != EMPTY) {
+                index = node.firstChild + quadrantFor(node, pos);
+                continue;
+            }
+            if (node.body == EMPTY) {
+                node.body = body;
+                return;
+            }
+            if (nextBody[node.body] != EMPTY || depth >= MAX_DEPTH || nodeCount + 4 > int(nodes.size())) {
+                nextBody[body] = node.body;
+                node.body = body;
+                return;
+            }
+
+            // Leaf with one body in it: push that body down a level and carry on inserting the new one
+            auto existing = node.body;
+            const auto &existingPos = bodyPositions[existing];
+            node.body = EMPTY;
+            split(index);
+            auto &child = nodes[nodes[index].firstChild + quadrantFor(nodes[index], existingPos)];
+            child.body = existing;
+            child.mass = bodyMasses[existing];
+            child.weightedPosition = bodyMasses[existing] * existingPos;
+            index = nodes[index].firstChild + quadrantFor(nodes[index], pos);
+        }
+    }
+
+public:
+    explicit BarnesHutTree(int maxBodies) :
+            nodes(size_t(1 + 8 * std::max(maxBodies, 1))),
+            bodyPositions(size_t(std::max(maxBodies, 1))),
+            bodyMasses(size_t(std::max(maxBodies, 1))),
+            nextBody(size_t(std::max(maxBodies, 1))) {}
+
+    // Ratio of node size to distance below which a whole node is treated as a single point mass. 0 gives the exact
+    // (and slow) answer, and around 0.5-1.0 is the usual trade-off
+    void setOpeningAngle(double theta) {
+        openingAngle = theta;
+    }
+
+    double getOpeningAngle() const {
+        return openingAngle;
+    }
+
+    /** Rebuild the tree from an array of bodies. The body type needs 'pos', 'mass' and 'enabled' members, and the
+     *  index of each body in the array is what identifies it in accelerationOn. Bodies beyond the number the tree was
+     *  made for are left out */
+    template <typename Body>
+    void build(const Body *bodies, int count) {
+        nodeCount = 0;
+        count = std::min(count, int(nextBody.size()));
+        std::fill(bodyMasses.begin(), bodyMasses.end(), 0.0);
+
+        double minX = 0, minY = 0, maxX = 0, maxY = 0;
+        bool first = true;
+        for (auto i = 0; i < count; i++) {
+            if (!bodies[i].enabled) continue;
+            const auto &p = bodies[i].pos;
+            minX = first ? p.x : std::min(minX, p.x);
+            minY = first ? p.y : std::min(minY, p.y);
+            maxX = first ? p.x : std::max(maxX, p.x);
+            maxY = first ? p.y : std::max(maxY, p.y);
+            first = false;
+        }
+        if (first) return;
+
+        auto halfSize = std::max(maxX - minX, maxY - minY) / 2 + 1.0;
+        initNode(0, {(minX + maxX) / 2, (minY + maxY) / 2}, halfSize);
+        nodeCount = 1;
+
+        for (auto i = 0; i < count; i++) {
+            if (!bodies[i].enabled) continue;
+            bodyPositions[size_t(i)] = bodies[i].pos;
+            bodyMasses[size_t(i)] = bodies[i].mass;
+            insert(i);
+        }
+    }
+
+    /** Sum of mass * direction / distance^2 acting on the given body from everything else in the tree.
+     *  'softening' is added to the distance so that near-misses don't produce enormous kicks. A body never attracts
+     *  itself: its own mass is taken back out of every node it is part of before that node is used */
+    Vec accelerationOn(int body, const Vec &pos, double softening) const {
+        Vec acceleration = {0, 0};
+        if (nodeCount == 0) return acceleration;
+
+        const double softeningSquared = softening * softening;
+        const double thetaSquared = openingAngle * openingAngle;
+        const bool inTree = body >= 0 && body < int(bodyMasses.size()) && bodyMasses[size_t(body)] > 0.0;
+        const double ownMass = inTree ? bodyMasses[size_t(body)] : 0.0;
+        const Vec ownPos = inTree ? bodyPositions[size_t(body)] : pos;
+
+        auto attract = [&] (double mass, const Vec &at) {
+            Vec offset = at - pos;
+            double softened = offset % offset + softeningSquared;
+            acceleration += (mass / (softened * std::sqrt(softened))) * offset;
+        };
+
+        // Each entry is a node index, doubled, plus one if the node is on the way down to the body's own leaf
+        int stack[3 * MAX_DEPTH + 4];
+        int stackSize = 0;
+        stack[stackSize++] = inTree ? 1 : 0;
+
+        while (stackSize > 0) {
+            const auto entry = stack[--stackSize];
+            const auto &node = nodes[entry >> 1];
+            const bool containsBody = (entry & 1) != 0;
+            if (node.mass == 0.0) continue;
+
+            if (node.firstChild == EMPTY) {
+                for (auto other = node.body; other != EMPTY; other = nextBody[size_t(other)]) {
+                    if (other != body) attract(bodyMasses[size_t(other)], bodyPositions[size_t(other)]);
+                }
+                continue;
+            }
+
+            const double mass = containsBody ? node.mass - ownMass : node.mass;
+            const Vec weightedPosition = containsBody ? node.weightedPosition - ownMass * ownPos : node.weightedPosition;
+            Vec centreOfMass = (1.0 / mass) * weightedPosition;
+            Vec offset = centreOfMass - pos;
+            double size = 2 * node.halfSize;
+
+            if (size * size < thetaSquared * (offset % offset)) {
+                attract(mass, centreOfMass);
+            } else {
+                const auto ownQuadrant = containsBody ? quadrantFor(node, ownPos) : -1;
+                for (auto q = 0; q < 4; q++) {
+                    stack[stackSize++] = 2 * (node.firstChild + q) + (q == ownQuadrant ? 1 : 0);
+                }
+            }
+        }
+        return acceleration;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_BARNESHUTTREE_H
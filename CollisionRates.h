@@ -0,0 +1,51 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_COLLISIONRATES_H
+#define PARTICLES_PLUGIN_COLLISIONRATES_H
+
+/** Estimated collision triggers per simulation step, broken down by midi note and by stereo region (vertical strips of
+ *  the chamber, left to right). This is what the simulation hands over instead of individual collisions when it is
+ *  running in its statistical level-of-detail mode
+ */
+struct CollisionRates {
+    static constexpr int NUM_NOTES = 128;
+    static constexpr int NUM_REGIONS = 8;
+
+    float rate[NUM_NOTES][NUM_REGIONS];
+    // Average trigger velocity (0..1) in each bin, weighted by rate
+    float velocity[NUM_NOTES][NUM_REGIONS];
+    // False when the simulation is producing exact collisions, in which case the tables are all zero
+    bool active = false;
+
+    void clear() {
+        for (auto note = 0; note < NUM_NOTES; note++) {
+            for (auto region = 0; region < NUM_REGIONS; region++) {
+                rate[note][region] = 0.0f;
+                velocity[note][region] = 0.0f;
+            }
+        }
+        active = false;
+    }
+
+    // Centre of a region in the same -1..1 pan range that individual collisions use
+    static float panForRegion(int region) {
+        return (float(region) + 0.5f) * 2.0f / float(NUM_REGIONS) - 1.0f;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_COLLISIONRATES_H
@@ -0,0 +1,190 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_COLLISIONTRACE_H
+#define PARTICLES_PLUGIN_COLLISIONTRACE_H
+
+#include <JuceHeader.h>
+
+/** Binary trace of everything that went into and came out of the simulation, so that a run can be replayed through
+ *  the synth without the physics (for profiling, or turning a glitch in a show into something reproducible).
+ *
+ *  The file is a small header followed by fixed-size records in time order. Times are in samples from the start of the
+ *  recording, at the sample rate given in the header.
+ */
+namespace CollisionTrace {
+    enum class RecordType : uint8 {
+        NOTE_ON = 1,
+        NOTE_OFF = 2,
+        COLLISION = 3,
+        // The level-of-detail cloud's rates for a step (see CollisionRates) follow, as CLOUD_RATE records
+        CLOUD_STEP = 4,
+        CLOUD_RATE = 5
+    };
+
+    /** One event. For CLOUD_STEP records, 'particle' is 1 while the cloud is playing and 0 once it has stopped; they are
+     *  only written while it is playing and for the step it stops on. Each CLOUD_RATE record after that gives one
+     *  nonzero bin: 'note' and 'other' (the region) pick the bin, 'velocity' is its average velocity and 'pan' carries
+     *  its rate in triggers per step */
+    struct Record {
+        int64 sampleTime;
+        float velocity;
+        float pan;
+        // Particle that rang, and the one it hit (-1 for an obstacle). Both are -1 for note input records
+        int32 particle;
+        int32 other;
+        RecordType type;
+        uint8 note;
+        uint8 reserved[2];
+    };
+    static_assert(sizeof(Record) == 32, "Trace records are written to disk as-is, so their layout must not change");
+
+    struct Header {
+        char magic[4];
+        uint32 version;
+        double sampleRate;
+    };
+    static_assert(sizeof(Header) == 16, "The trace header is written to disk as-is, so its layout must not change");
+
+    constexpr char MAGIC[4] = {'P', 'T', 'R', 'C'};
+    // Version 2 added the cloud records. Version 1 traces can still be replayed, as they just don't have any
+    constexpr uint32 VERSION = 2;
+
+    /** Streams records to a file. record() is called from the audio thread and only ever copies into a preallocated
+     *  FIFO; a background thread drains it to disk. If the disk can't keep up, records are dropped (and counted)
+     *  rather than blocking the audio thread */
+    class Writer : private Thread {
+    private:
+        static constexpr int FIFO_SIZE = 1 << 16;
+
+        std::unique_ptr<FileOutputStream> stream;
+        AbstractFifo fifo {FIFO_SIZE};
+        std::vector<Record> buffer;
+        std::atomic<uint64> droppedRecords {0};
+
+        void drain() {
+            const auto scope = fifo.read(fifo.getNumReady());
+            if (scope.blockSize1 > 0) stream->write(buffer.data() + scope.startIndex1, size_t(scope.blockSize1) * sizeof(Record));
+            if (scope.blockSize2 > 0) stream->write(buffer.data() + scope.startIndex2, size_t(scope.blockSize2) * sizeof(Record));
+        }
+
+        void run() override {
+            while (!threadShouldExit()) {
+                drain();
+                wait(10);
+            }
+            drain();
+            stream->flush();
+        }
+
+    public:
+        Writer(): Thread("Collision trace writer"), buffer(FIFO_SIZE) {}
+
+        ~Writer() override {
+            stop();
+        }
+
+        bool start(const File &file, double sampleRate) {
+            stop();
+            file.deleteFile();
+            stream = std::make_unique<FileOutputStream>(file);
+            if (stream->failedToOpen()) {
+                stream.reset();
+                return false;
+            }
+            Header header {};
+            std::copy(std::begin(MAGIC), std::end(MAGIC), header.magic);
+            header.version = VERSION;
+            header.sampleRate = sampleRate;
+            stream->write(&header, sizeof(header));
+            startThread();
+            return true;
+        }
+
+        void stop() {
+            if (isThreadRunning()) {
+                stopThread(1000);
+            }
+            stream.reset();
+        }
+
+        void record(const Record &record) {
+            const auto scope = fifo.write(1);
+            if (scope.blockSize1 > 0) {
+                buffer[size_t(scope.startIndex1)] = record;
+            } else {
+                droppedRecords.store(droppedRecords.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+        }
+
+        uint64 getDroppedRecordCount() const {
+            return droppedRecords.load(std::memory_order_relaxed);
+        }
+    };
+
+    /** Memory-maps a trace file for replay. Records are read straight out of the mapping, so opening even a very long
+     *  trace costs nothing up front and replaying it doesn't allocate */
+    class Reader {
+    private:
+        std::unique_ptr<MemoryMappedFile> mapping;
+        const Record *records = nullptr;
+        size_t numRecords = 0;
+        size_t cursor = 0;
+        double sampleRate = 0.0;
+
+    public:
+        bool open(const File &file) {
+            mapping = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+            auto data = static_cast<const char*>(mapping->getData());
+            auto size = mapping->getSize();
+            if (data == nullptr || size < sizeof(Header)) {
+                mapping.reset();
+                return false;
+            }
+            auto header = reinterpret_cast<const Header*>(data);
+            if (!std::equal(std::begin(MAGIC), std::end(MAGIC), header->magic) || header->version < 1
+                || header->version > VERSION) {
+                mapping.reset();
+                return false;
+            }
+            sampleRate = header->sampleRate;
+            records = reinterpret_cast<const Record*>(data + sizeof(Header));
+            numRecords = (size - sizeof(Header)) / sizeof(Record);
+            cursor = 0;
+            return true;
+        }
+
+        double getSampleRate() const { return sampleRate; }
+        size_t getNumRecords() const { return numRecords; }
+        bool isFinished() const { return cursor >= numRecords; }
+
+        void rewind() {
+            cursor = 0;
+        }
+
+        // Hand every record with a time before 'end' to the callback, moving the cursor past them
+        template <typename Callback>
+        void readUntil(int64 end, Callback &&callback) {
+            while (cursor < numRecords && records[cursor].sampleTime < end) {
+                callback(records[cursor]);
+                cursor++;
+            }
+        }
+    };
+}
+
+#endif //PARTICLES_PLUGIN_COLLISIONTRACE_H
@@ -0,0 +1,205 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_GRAINCLOUD_H
+#define PARTICLES_PLUGIN_GRAINCLOUD_H
+
+#include <cmath>
+#include <cstdint>
+#include "CollisionRates.h"
+
+/** Stochastic grain engine for the simulation's level-of-detail mode
+ *  When there are so many particles that the individual hits blur into a texture, the simulation only reports how often
+ *  each note is being hit in each part of the chamber. This turns those rates back into sound by scattering short grains
+ *  at random (Poisson distributed) times. The grains sound like the normal voices, but there are a fixed number of them,
+ *  so the cost stays put however dense the cloud gets.
+ */
+class GrainCloud {
+private:
+    static constexpr int MAX_GRAINS = 64;
+    static constexpr float TAU = 6.283185307179586f;
+    static constexpr float OUTPUT_GAIN = 0.2f;
+    static constexpr float SILENCE_LEVEL = 0.001f;
+
+    struct Grain {
+        float phase = 0.0f;
+        float increment = 0.0f;
+        float level = 0.0f;
+        float attack = 0.0f;
+        float leftGain = 0.0f;
+        float rightGain = 0.0f;
+        // Sample within the current block that a newly started grain begins at
+        int startOffset = 0;
+        int note = -1;
+        bool active = false;
+    };
+
+    Grain grains[MAX_GRAINS];
+
+    // Expected grains per second and their velocity, for every note and region
+    float rates[CollisionRates::NUM_NOTES][CollisionRates::NUM_REGIONS] = {};
+    float velocities[CollisionRates::NUM_NOTES][CollisionRates::NUM_REGIONS] = {};
+    bool hasRates = false;
+
+    float sampleRate = 44100.0f;
+    float attackTime = 0.01f;
+    float decayHalfLife = 0.05f;
+    float waveform = 0.0f;
+
+    uint32_t randomState = 0x9e3779b9u;
+
+    // xorshift32, which is plenty for scattering grains and doesn't need anything outside this class
+    float nextRandom() {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return float(randomState >> 8) / float(1 << 24);
+    }
+
+    int poisson(float mean) {
+        if (mean > 30.0f) {
+            // Normal approximation; the exact method gets slow and we can't start that many grains anyway
+            float u1 = nextRandom() + 1.0e-7f, u2 = nextRandom();
+            float gaussian = std::sqrt(-2.0f * std::log(u1)) * std::cos(TAU * u2);
+            float n = mean + std::sqrt(mean) * gaussian + 0.5f;
+            return n < 0.0f ? 0 : int(n);
+        }
+        const float limit = std::exp(-mean);
+        int k = 0;
+        float p = nextRandom();
+        while (p > limit) {
+            k++;
+            p *= nextRandom();
+        }
+        return k;
+    }
+
+    static float noteInHertz(int note) {
+        return 440.0f * std::pow(2.0f, float(note - 69) / 12.0f);
+    }
+
+    inline float oscFunction(float a) const {
+        return (1.0f - waveform) * std::sin(a) + waveform * (2.0f * (a / TAU) - 1.0f);
+    }
+
+    void startGrain(int note, float velocity, float pan, int offset) {
+        Grain *target = nullptr;
+        for (auto &grain : grains) {
+            if (!grain.active) {
+                target = &grain;
+                break;
+            }
+            // With every grain busy, the quietest one makes way
+            if (target == nullptr || grain.level < target->level) target = &grain;
+        }
+        if (target->active && target->level > velocity) return;
+
+        // Same equal-power pan law as the voices
+        const float factor = std::sqrt(2.0f) / 2.0f;
+        const float angle = pan * (TAU / 8.0f);
+        target->leftGain = factor * (std::cos(angle) - std::sin(angle));
+        target->rightGain = factor * (std::cos(angle) + std::sin(angle));
+
+        target->phase = 0.0f;
+        target->increment = TAU * noteInHertz(note) * (0.995f + 0.01f * nextRandom()) / sampleRate;
+        target->level = velocity;
+        target->attack = 0.0f;
+        target->startOffset = offset;
+        target->note = note;
+        target->active = true;
+    }
+
+public:
+    void setSampleRate(float newSampleRate) {
+        sampleRate = newSampleRate;
+    }
+
+    void setAttackTime(float newAttackTime) {
+        attackTime = newAttackTime;
+    }
+
+    void setDecayHalfLife(float halfLife) {
+        decayHalfLife = halfLife;
+    }
+
+    void setWaveform(float newWaveform) {
+        waveform = newWaveform;
+    }
+
+    // Take the latest per-step rates from the simulation. Inactive rates stop any new grains, but leave the ones
+    // already sounding to ring out
+    void setRates(const CollisionRates &perStep, float stepsPerSecond) {
+        hasRates = perStep.active;
+        if (!hasRates) return;
+        for (auto note = 0; note < CollisionRates::NUM_NOTES; note++) {
+            for (auto region = 0; region < CollisionRates::NUM_REGIONS; region++) {
+                rates[note][region] = perStep.rate[note][region] * stepsPerSecond;
+                velocities[note][region] = perStep.velocity[note][region];
+            }
+        }
+    }
+
+    bool isSilent() const {
+        if (hasRates) return false;
+        for (const auto &grain : grains) {
+            if (grain.active) return false;
+        }
+        return true;
+    }
+
+    // Add the cloud to the given stereo buffers
+    void render(float *left, float *right, int numSamples) {
+        if (numSamples <= 0) return;
+
+        if (hasRates) {
+            const float blockSeconds = float(numSamples) / sampleRate;
+            for (auto note = 0; note < CollisionRates::NUM_NOTES; note++) {
+                for (auto region = 0; region < CollisionRates::NUM_REGIONS; region++) {
+                    if (rates[note][region] <= 0.0f) continue;
+                    int count = poisson(rates[note][region] * blockSeconds);
+                    if (count > MAX_GRAINS) count = MAX_GRAINS;
+                    for (auto i = 0; i < count; i++) {
+                        startGrain(note, velocities[note][region], CollisionRates::panForRegion(region),
+                                   int(nextRandom() * float(numSamples)));
+                    }
+                }
+            }
+        }
+
+        const float attackIncrement = 1.0f / (sampleRate * attackTime);
+        const float decayFactor = std::pow(0.5f, 1.0f / (sampleRate * decayHalfLife));
+        for (auto &grain : grains) {
+            if (!grain.active) continue;
+            for (auto i = grain.startOffset; i < numSamples; i++) {
+                float sample = oscFunction(grain.phase) * grain.level * (grain.attack < 1.0f ? grain.attack : 1.0f);
+                grain.phase += grain.increment;
+                if (grain.phase > TAU) grain.phase -= TAU;
+                grain.level *= decayFactor;
+                grain.attack += attackIncrement;
+
+                left[i] += grain.leftGain * sample * OUTPUT_GAIN;
+                right[i] += grain.rightGain * sample * OUTPUT_GAIN;
+            }
+            grain.startOffset = 0;
+            if (grain.level < SILENCE_LEVEL) {
+                grain.active = false;
+            }
+        }
+    }
+};
+
+#endif //PARTICLES_PLUGIN_GRAINCLOUD_H
@@ -0,0 +1,363 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ParticleSimulation.h"
+#include "TimelineTrace.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+ParticleSimulation::Arena::Arena(int capacity):
+        particles(static_cast<Particle*>(::operator new(sizeof(Particle) * size_t(capacity), ALIGNMENT))),
+        capacity(capacity),
+        forceTree(capacity) {
+    std::uninitialized_default_construct_n(particles, capacity);
+}
+
+ParticleSimulation::Arena::~Arena() {
+    std::destroy_n(particles, capacity);
+    ::operator delete(particles, ALIGNMENT);
+}
+
+ParticleSimulation::ParticleSimulation(int capacity): arena(new Arena(capacity)) {}
+
+void ParticleSimulation::adoptPendingArena() {
+    auto next = pendingArena.exchange(nullptr);
+    if (next == nullptr) return;
+
+    auto previous = arena.load();
+    int count = 0;
+    for (auto i = 0; i < previous->slotsInUse && count < next->capacity; i++) {
+        if (previous->particles[i].enabled) {
+            next->particles[count++] = previous->particles[i];
+        }
+    }
+    next->slotsInUse = count;
+
+    arena = next;
+    retireArena(previous);
+}
+
+void ParticleSimulation::retireArena(Arena *retired) {
+    for (auto &slot : retiredArenas) {
+        Arena *empty = nullptr;
+        if (slot.compare_exchange_strong(empty, retired)) return;
+    }
+    // Can't happen with the slots we have, but if it did, leaking an arena is better than freeing on the audio thread
+}
+
+int ParticleSimulation::findFreeParticle() {
+    auto &store = *arena.load();
+    for (auto i = 0; i < store.capacity; i++) {
+        if (!store.particles[i].enabled) return i;
+    }
+    return -1;
+}
+
+void ParticleSimulation::generateTopLeft(Particle &p, float velocity) {
+    p.pos = {rnd.nextFloat() * 200, rnd.nextFloat() * 200};
+    p.vel = 4 * velocity * normalise({rnd.nextFloat(), rnd.nextFloat()});
+}
+
+void ParticleSimulation::generateRandomInside(Particle &p, float velocity) {
+    p.pos = {rnd.nextFloat() * w, rnd.nextFloat() * h};
+    p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat() - 0.5f});
+}
+
+void ParticleSimulation::generateRandomOutside(Particle &p, float velocity) {
+    if (rnd.nextBool()) {
+        p.pos = {
+                rnd.nextFloat() * 100 + (rnd.nextBool() ? -100.0f : w),
+                rnd.nextFloat() * h
+        };
+    } else {
+        p.pos = {
+                rnd.nextFloat() * w,
+                rnd.nextFloat() * 100+ (rnd.nextBool() ? -100.0f : h)
+        };
+    }
+    p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat() - 0.5f});
+}
+
+void ParticleSimulation::generateTopRandom(Particle &p, float velocity) {
+    p.pos = {rnd.nextFloat() * w, - rnd.nextFloat() * 100};
+    p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat()});
+}
+
+void ParticleSimulation::setParticleProperties(Particle &p, int noteNumber) {
+    p.note = noteNumber;
+    p.mass = sizeByNote ? particleScale * 100000.0 / (110.0 * (pow(2.0, (p.note / 12.0)))) : 300.0f * particleScale;
+    p.hue = 30 + 360.0 * (p.note % 12) / 12.0;
+    p.radius =  sqrt(p.mass) * 4;
+    p.lastCollided = 1000;
+    p.enabled = true;
+}
+
+void ParticleSimulation::setupParticle(Particle &p, int noteNumber, float velocity) {
+    setParticleProperties(p, noteNumber);
+    switch (particleOrigin) {
+        case ParticleOrigin::TOP_LEFT:
+            generateTopLeft(p, velocity);
+            break;
+        case ParticleOrigin::RANDOM_INSIDE:
+            generateRandomInside(p, velocity);
+            break;
+        case ParticleOrigin::RANDOM_OUTSIDE:
+            generateRandomOutside(p, velocity);
+            break;
+        case ParticleOrigin::TOP_RANDOM:
+            generateTopRandom(p, velocity);
+            break;
+    }
+}
+
+void ParticleSimulation::createParticle(int noteNumber, float velocity) {
+    int freeParticle = findFreeParticle();
+    if (freeParticle != -1) {
+        auto &store = *arena.load();
+        setupParticle(store.particles[freeParticle], noteNumber, velocity);
+        store.particles[freeParticle].id = ++nextParticleId;
+        if (freeParticle >= store.slotsInUse) store.slotsInUse = freeParticle + 1;
+    }
+}
+
+void ParticleSimulation::applyAttraction(Arena &store, float timeScale) {
+    TRACE_SCOPE("forces");
+    const int slots = store.slotsInUse;
+    store.forceTree.setOpeningAngle(openingAngle);
+    store.forceTree.build(store.particles, slots);
+    const double strength = ATTRACTION_SCALE * attraction * timeScale;
+    for (auto i = 0; i < slots; i++) {
+        auto &p = store.particles[i];
+        if (p.enabled) {
+            p.vel += strength * store.forceTree.accelerationOn(i, p.pos, ATTRACTION_SOFTENING);
+        }
+    }
+}
+
+int ParticleSimulation::cellFor(const Vec &pos) const {
+    int x = int(pos.x * GRID_SIZE / w);
+    int y = int(pos.y * GRID_SIZE / h);
+    x = x < 0 ? 0 : x >= GRID_SIZE ? GRID_SIZE - 1 : x;
+    y = y < 0 ? 0 : y >= GRID_SIZE ? GRID_SIZE - 1 : y;
+    return y * GRID_SIZE + x;
+}
+
+void ParticleSimulation::estimateCollisionRates(const Particle *particles, int slots, float timeScale) {
+    TRACE_SCOPE("collision rates");
+    for (auto &cell : grid) {
+        cell = {0, 0.0, 0.0};
+    }
+    for (auto i = 0; i < slots; i++) {
+        const auto &p = particles[i];
+        if (!p.enabled) continue;
+        auto &cell = grid[cellFor(p.pos)];
+        cell.count++;
+        cell.radiusSum += p.radius;
+        cell.speedSquaredSum += p.vel % p.vel;
+    }
+
+    collisionRates.clear();
+    const double cellArea = (w / GRID_SIZE) * (h / GRID_SIZE);
+    for (auto i = 0; i < slots; i++) {
+        const auto &p = particles[i];
+        if (!p.enabled) continue;
+        const auto &cell = grid[cellFor(p.pos)];
+        if (cell.count < 2) continue;
+
+        auto others = cell.count - 1;
+        auto otherRadius = (cell.radiusSum - p.radius) / others;
+        auto relativeSpeed = sqrt(2.0 * cell.speedSquaredSum / cell.count);
+        auto rate = float((others / cellArea) * 2.0 * (p.radius + otherRadius) * relativeSpeed * timeScale);
+
+        int note = p.note + 33;
+        if (note >= CollisionRates::NUM_NOTES) continue;
+        int region = int(p.pos.x * CollisionRates::NUM_REGIONS / w);
+        region = region < 0 ? 0 : region >= CollisionRates::NUM_REGIONS ? CollisionRates::NUM_REGIONS - 1 : region;
+
+        collisionRates.rate[note][region] += rate;
+        collisionRates.velocity[note][region] += rate * clamp(length(p.vel)/10);
+    }
+
+    for (auto note = 0; note < CollisionRates::NUM_NOTES; note++) {
+        for (auto region = 0; region < CollisionRates::NUM_REGIONS; region++) {
+            auto rate = collisionRates.rate[note][region];
+            collisionRates.velocity[note][region] = rate > 0.0f ? collisionRates.velocity[note][region] / rate : 0.0f;
+        }
+    }
+    collisionRates.active = true;
+}
+
+ParticleSimulation::~ParticleSimulation() {
+    delete pendingArena.load();
+    for (auto &slot : retiredArenas) {
+        delete slot.load();
+    }
+    delete arena.load();
+}
+
+void ParticleSimulation::setCapacity(int capacity) {
+    for (auto &slot : retiredArenas) {
+        delete slot.exchange(nullptr);
+    }
+    if (capacity < 1) capacity = 1;
+    // If the previous request was never picked up it can be thrown away, as the audio thread can no longer see it
+    delete pendingArena.exchange(new Arena(capacity));
+}
+
+bool ParticleSimulation::saveCheckpoint(Checkpoint &checkpoint) const {
+    const auto &store = *arena.load();
+    const int slots = store.slotsInUse;
+    if (slots > checkpoint.getCapacity()) return false;
+    std::copy(store.particles, store.particles + slots, checkpoint.particles.begin());
+    checkpoint.slotsInUse = slots;
+    checkpoint.random = rnd;
+    return true;
+}
+
+bool ParticleSimulation::restoreCheckpoint(const Checkpoint &checkpoint) {
+    adoptPendingArena();
+    auto &store = *arena.load();
+    if (checkpoint.slotsInUse > store.capacity) return false;
+    std::copy(checkpoint.particles.begin(), checkpoint.particles.begin() + checkpoint.slotsInUse, store.particles);
+    for (auto i = checkpoint.slotsInUse; i < store.slotsInUse; i++) {
+        store.particles[i].enabled = false;
+    }
+    store.slotsInUse = checkpoint.slotsInUse;
+    rnd = checkpoint.random;
+    return true;
+}
+
+void ParticleSimulation::addNote(int noteNumber, float velocity) {
+    adoptPendingArena();
+    for (auto i = 0; i < particleGenerationMultiplier; i++) {
+        createParticle(noteNumber, velocity);
+    }
+}
+
+void ParticleSimulation::removeNote(int noteNumber) {
+    adoptPendingArena();
+    auto &store = *arena.load();
+    int slots = store.slotsInUse;
+    for (auto i = 0; i < slots; i++) {
+        auto &particle = store.particles[i];
+        if (particle.enabled && particle.note == noteNumber) {
+            particle.enabled = false;
+        }
+    }
+    while (slots > 0 && !store.particles[slots - 1].enabled) slots--;
+    store.slotsInUse = slots;
+}
+
+int ParticleSimulation::integrate(Particle *particles, int slots, float timeScale) {
+    TRACE_SCOPE("integrate");
+    int enabledCount = 0;
+    for (auto i = 0; i < slots; i++) {
+        auto &p = particles[i];
+        if (p.enabled) {
+            enabledCount++;
+            p.pos += timeScale * p.vel;
+            p.vel.y = p.vel.y + 0.05 * gravity;
+            if (p.pos.x < 0) p.vel.x = std::abs(p.vel.x);
+            if (p.pos.y < 0) p.vel.y = std::abs(p.vel.y);
+            if (p.pos.x > w) p.vel.x = -std::abs(p.vel.x);
+            if (p.pos.y > h) p.vel.y = -std::abs(p.vel.y);
+            p.lastCollided += timeScale;
+        }
+    }
+    return enabledCount;
+}
+
+void ParticleSimulation::collideWithObstacles(const StaticGeometry &obstacles, Particle *particles, int slots,
+                                              const std::function<void (int, float, float, int, int)> &collisionCallback) {
+    TRACE_SCOPE("obstacles");
+    for (auto i = 0; i < slots; i++) {
+        auto &p = particles[i];
+        if (!p.enabled) continue;
+        StaticGeometry::Contact contact{};
+        if (obstacles.findContact(p.pos, p.radius, contact)) {
+            // Obstacles are immovable, so the particle is simply reflected if it is heading into the surface
+            double approachSpeed = p.vel % contact.normal;
+            if (approachSpeed < 0) {
+                p.vel -= (2 * approachSpeed) * contact.normal;
+                collisionCallback(p.note + 33, clamp(length(p.vel)/10), float(p.pos.x / 500.0) - 1.0f, i, -1);
+                p.lastCollided = 0;
+            }
+        }
+    }
+}
+
+void ParticleSimulation::collideParticles(Particle *particles, int slots,
+                                          const std::function<void (int, float, float, int, int)> &collisionCallback) {
+    TRACE_SCOPE("particle collisions");
+    for (auto i = 0; i < slots; i++) {
+        if (!particles[i].enabled) continue;
+        for (auto j = 0; j < slots; j++) {
+            if (i == j || !particles[j].enabled) continue;
+            Particle &a = particles[i];
+            Particle &b = particles[j];
+            // check if particles are intersection
+            if (dist(a.pos,b.pos) < (a.radius + b.radius)) {
+                // check to make sure they're not already moving away from each other (helps with glitches)
+                if (dist(a.pos, b.pos) > dist(a.pos + a.vel, b.pos + b.vel)) {
+                    double massA = 2 * b.mass / (a.mass + b.mass);
+                    double massB = 2 * a.mass / (a.mass + b.mass);
+                    Vec dif = a.pos - b.pos;
+                    double normalisedDotProduct = ((a.vel - b.vel) % dif) / (pow(length(dif),2));
+
+                    Vec aNewVel = a.vel - massA * normalisedDotProduct * dif;
+                    Vec bNewVel = b.vel + massB * normalisedDotProduct * dif;
+
+                    a.vel = aNewVel;
+                    b.vel = bNewVel;
+
+                    collisionCallback(a.note + 33, clamp(length(a.vel)/10), float(a.pos.x / 500.0) - 1.0f, i, j);
+                    collisionCallback(b.note + 33, clamp(length(b.vel)/10), float(b.pos.x / 500.0) - 1.0f, j, i);
+
+                    a.lastCollided = 0;
+                    b.lastCollided = 0;
+                }
+            }
+        }
+    }
+}
+
+void ParticleSimulation::step(const std::function<void (int, float, float, int, int)> &collisionCallback, float timeScale) {
+    TRACE_SCOPE("sim step");
+    adoptPendingArena();
+    auto &store = *arena.load();
+    auto particles = store.particles;
+    const int slots = store.slotsInUse;
+
+    if (attraction != 0.0f) {
+        applyAttraction(store, timeScale);
+    }
+    const int enabledCount = integrate(particles, slots, timeScale);
+    auto obstacles = geometry.load();
+    if (obstacles != nullptr && !obstacles->isEmpty()) {
+        collideWithObstacles(*obstacles, particles, slots, collisionCallback);
+    }
+    // The chamber is a fixed size, so the particle count is effectively the density
+    if (levelOfDetailThreshold > 0 && enabledCount > levelOfDetailThreshold) {
+        estimateCollisionRates(particles, slots, timeScale);
+        return;
+    }
+    if (collisionRates.active) {
+        collisionRates.clear();
+    }
+    collideParticles(particles, slots, collisionCallback);
+}
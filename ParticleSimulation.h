@@ -17,8 +17,16 @@
 
 #ifndef PARTICLES_PLUGIN_PARTICLESIMULATION_H
 #define PARTICLES_PLUGIN_PARTICLESIMULATION_H
-#include <JuceHeader.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <vector>
 #include "Vec.h"
+#include "SimulationRandom.h"
+#include "StaticGeometry.h"
+#include "BarnesHutTree.h"
+#include "CollisionRates.h"
 
 // I'm aware that the way I do this is sort of a manual implementation of polymorphism; but given this is a simple
 // function substitution in a CPU-heavy simulation, I decided to keep it as a simple enum switch instead of what would
@@ -40,19 +48,50 @@ private:
         double radius = 1.0;
         float lastCollided = 1000;
         int note = 32;
+        // Given out afresh every time a particle is created, so anything following particles from one step to the
+        // next can tell a new particle from an old one that was in the same slot
+        uint32_t id = 0;
         bool enabled = false;
     };
 
-    static constexpr int MAX_PARTICLES = 200;
+    /** Storage for a fixed number of particles, along with everything else that has to be sized to match.
+     *  We do not "add" or "remove" particles, but keep them all initialized and flag them as 'enabled' or not. The
+     *  particles are cache-line aligned so a future vectorised step can rely on it */
+    struct Arena {
+        static constexpr std::align_val_t ALIGNMENT {64};
+
+        Particle *const particles;
+        const int capacity;
+        // No particle at or beyond this index is enabled, so loops never need to look any further
+        std::atomic<int> slotsInUse {0};
+        BarnesHutTree forceTree;
+
+        explicit Arena(int capacity);
+        ~Arena();
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+    };
 
     friend class ParticleSimulationVisualiser;
+    friend class SharedStatePublisher;
+    friend class SimulationFrameBuffer;
 
     const float w = 1000;
     const float h = 1000;
 
-    // We do not "add" or "remove" particles, but keep them all initialized and flag them as 'enabled' or not
-    Particle particles[MAX_PARTICLES];
-    Random rnd;
+    // The arena in use is only ever replaced by the audio thread, when it picks up a pending one at the start of a
+    // call. The one it replaces is parked as 'retired' until the next setCapacity call frees it, so nothing is ever
+    // allocated or freed on the audio thread
+    std::atomic<Arena*> arena;
+    std::atomic<Arena*> pendingArena {nullptr};
+    // A couple of arenas can be retired between two setCapacity calls (if one lands while the audio thread is part way
+    // through adopting the last), so there's room for a few
+    static constexpr int MAX_RETIRED_ARENAS = 4;
+    std::atomic<Arena*> retiredArenas[MAX_RETIRED_ARENAS] {};
+
+    SimulationRandom rnd;
+    uint32_t nextParticleId = 0;
 
     float gravity = 0.0f;
 
@@ -63,99 +102,117 @@ private:
     bool sizeByNote = true;
     float particleScale = 1.0f;
 
+    // Strength of the pull between particles (negative values repel). At zero the force stage is skipped entirely
+    float attraction = 0.0f;
+    double openingAngle = 0.5;
+
+    // Above this many particles individual collisions are replaced by estimated collision rates (0 turns this off)
+    int levelOfDetailThreshold = 0;
+
+    // The chamber is divided into a coarse grid, and the occupancy and speed statistics of each cell drive the
+    // collision rate estimate. Particles outside the chamber are counted in the nearest edge cell
+    static constexpr int GRID_SIZE = 20;
+    struct GridCell {
+        int count;
+        double radiusSum;
+        double speedSquaredSum;
+    };
+    GridCell grid[GRID_SIZE * GRID_SIZE] {};
+    CollisionRates collisionRates {};
+
+    // Obstacles are owned elsewhere and swapped in as a whole, so that changing layout never rebuilds anything here
+    std::atomic<const StaticGeometry*> geometry {nullptr};
+
+    // Move over to a newly sized arena if one has been published, carrying across as many live particles as fit
+    void adoptPendingArena();
+    void retireArena(Arena *retired);
+
     // Find the first particle in the array with 'enabled' set to false
-    int findFreeParticle() {
-        for (auto i = 0; i < MAX_PARTICLES; i++) {
-            if (!particles[i].enabled) return i;
-        }
-        return -1;
-    }
+    int findFreeParticle();
 
-    void generateTopLeft(Particle &p, float velocity) {
-        p.pos = {rnd.nextFloat() * 200, rnd.nextFloat() * 200};
-        p.vel = 4 * velocity * normalise({rnd.nextFloat(), rnd.nextFloat()});
-    }
+    void generateTopLeft(Particle &p, float velocity);
+    void generateRandomInside(Particle &p, float velocity);
+    void generateRandomOutside(Particle &p, float velocity);
+    void generateTopRandom(Particle &p, float velocity);
 
-    void generateRandomInside(Particle &p, float velocity) {
-        p.pos = {rnd.nextFloat() * w, rnd.nextFloat() * h};
-        p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat() - 0.5f});
-    }
+    void setParticleProperties(Particle &p, int noteNumber);
+    void setupParticle(Particle &p, int noteNumber, float velocity);
+    void createParticle(int noteNumber, float velocity);
 
-    void generateRandomOutside(Particle &p, float velocity) {
-        if (rnd.nextBool()) {
-            p.pos = {
-                    rnd.nextFloat() * 100 + (rnd.nextBool() ? -100.0f : w),
-                    rnd.nextFloat() * h
-            };
-        } else {
-            p.pos = {
-                    rnd.nextFloat() * w,
-                    rnd.nextFloat() * 100+ (rnd.nextBool() ? -100.0f : h)
-            };
-        }
-        p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat() - 0.5f});
-    }
+    // Scales the -1..1 attraction setting into something comparable with the gravity force, and keeps close passes
+    // from flinging particles out of the chamber
+    static constexpr double ATTRACTION_SCALE = 50.0;
+    static constexpr double ATTRACTION_SOFTENING = 40.0;
 
-    void generateTopRandom(Particle &p, float velocity) {
-        p.pos = {rnd.nextFloat() * w, - rnd.nextFloat() * 100};
-        p.vel = 4 * velocity * normalise({rnd.nextFloat() - 0.5f, rnd.nextFloat()});
-    }
+    void applyAttraction(Arena &store, float timeScale);
 
-    void setParticleProperties(Particle &p, int noteNumber) {
-        p.note = noteNumber;
-        p.mass = sizeByNote ? particleScale * 100000.0 / (110.0 * (pow(2.0, (p.note / 12.0)))) : 300.0f * particleScale;
-        p.hue = 30 + 360.0 * (p.note % 12) / 12.0;
-        p.radius =  sqrt(p.mass) * 4;
-        p.lastCollided = 1000;
-        p.enabled = true;
-    }
+    // The stages of a step. integrate returns the number of enabled particles
+    int integrate(Particle *particles, int slots, float timeScale);
+    void collideWithObstacles(const StaticGeometry &obstacles, Particle *particles, int slots,
+                              const std::function<void (int, float, float, int, int)> &collisionCallback);
+    void collideParticles(Particle *particles, int slots,
+                          const std::function<void (int, float, float, int, int)> &collisionCallback);
 
-    void setupParticle(Particle &p, int noteNumber, float velocity) {
-        setParticleProperties(p, noteNumber);
-        switch (particleOrigin) {
-            case ParticleOrigin::TOP_LEFT:
-                generateTopLeft(p, velocity);
-                break;
-            case ParticleOrigin::RANDOM_INSIDE:
-                generateRandomInside(p, velocity);
-                break;
-            case ParticleOrigin::RANDOM_OUTSIDE:
-                generateRandomOutside(p, velocity);
-                break;
-            case ParticleOrigin::TOP_RANDOM:
-                generateTopRandom(p, velocity);
-                break;
-        }
-    }
+    int cellFor(const Vec &pos) const;
 
-    void createParticle(int noteNumber, float velocity) {
-        int freeParticle = findFreeParticle();
-        if (freeParticle != -1) {
-            setupParticle(particles[freeParticle], noteNumber, velocity);
-        }
-    }
+    /** Kinetic-theory estimate of how often each particle is being hit: a particle sweeps out 2 * (r + r') * v_rel of
+     *  area per unit time, and collides with whatever of the cell's density falls in that area. The relative speed of
+     *  randomly moving particles is taken as sqrt(2) times their rms speed */
+    void estimateCollisionRates(const Particle *particles, int slots, float timeScale);
 
     static inline float clamp(float value) {
         return value < 0.0f ? 0.0f : value > 1.0f ? 1.0f : value;
     }
 
 public:
-    explicit ParticleSimulation() {}
-
-    void addNote(int noteNumber, float velocity) {
-        for (auto i = 0; i < particleGenerationMultiplier; i++) {
-            createParticle(noteNumber, velocity);
+    static constexpr int DEFAULT_CAPACITY = 200;
+
+    explicit ParticleSimulation(int capacity = DEFAULT_CAPACITY);
+    ~ParticleSimulation();
+
+    /** A copy of everything in the simulation that changes as it runs: the particles and the random number generator.
+     *  Settings aren't included, as they belong to whoever is driving the simulation. The storage is allocated when the
+     *  checkpoint is created, so saving and restoring can be done on the audio thread */
+    class Checkpoint {
+    private:
+        friend class ParticleSimulation;
+        std::vector<Particle> particles;
+        int slotsInUse = 0;
+        SimulationRandom random {0};
+
+    public:
+        explicit Checkpoint(int capacity = 0): particles(size_t(capacity)) {}
+
+        int getCapacity() const {
+            return int(particles.size());
         }
+    };
+
+    // Copy the current state into a checkpoint. Returns false (and leaves the checkpoint alone) if it doesn't fit
+    bool saveCheckpoint(Checkpoint &checkpoint) const;
+
+    // Put the simulation back to a saved state. Returns false if it holds more particles than the arena can take
+    bool restoreCheckpoint(const Checkpoint &checkpoint);
+
+    /** Change how many particles the simulation can hold. This allocates, so it must not be called from the audio
+     *  thread; the new arena is picked up by the audio thread on its next call, without blocking it. Any particles which
+     *  don't fit into a smaller arena are dropped. Call this from the same thread as anything that reads the particles
+     *  (i.e. the message thread), since it is also where replaced arenas get freed */
+    void setCapacity(int capacity);
+
+    // True when there are no particles, so stepping would do nothing
+    bool isIdle() const {
+        return arena.load()->slotsInUse == 0;
     }
 
-    void removeNote(int noteNumber) {
-        for (auto & particle : particles) {
-            if (particle.enabled && particle.note == noteNumber) {
-                particle.enabled = false;
-            }
-        }
+    int getCapacity() const {
+        auto pending = pendingArena.load();
+        return pending != nullptr ? pending->capacity : arena.load()->capacity;
     }
 
+    void addNote(int noteNumber, float velocity);
+    void removeNote(int noteNumber);
+
     void setParticleMultiplier(int newValue) {
         particleGenerationMultiplier = newValue;
     }
@@ -176,51 +233,33 @@ public:
         particleScale = scale;
     }
 
+    void setAttraction(float newAttraction) {
+        attraction = newAttraction;
+    }
 
-    // Step the simulation. The callback takes a midi note, a clamped velocity and a pan value
-    void step(const std::function<void (int, float, float)> &collisionCallback, float timeScale = 1.0f) {
-        for (auto & p : particles) {
-            if (p.enabled) {
-                p.pos += timeScale * p.vel;
-                p.vel.y = p.vel.y + 0.05 * gravity;
-                if (p.pos.x < 0) p.vel.x = abs(p.vel.x);
-                if (p.pos.y < 0) p.vel.y = abs(p.vel.y);
-                if (p.pos.x > w) p.vel.x = -abs(p.vel.x);
-                if (p.pos.y > h) p.vel.y = -abs(p.vel.y);
-                p.lastCollided += timeScale;
-            }
-        }
-        for (auto i = 0; i < MAX_PARTICLES; i++) {
-            if (!particles[i].enabled) continue;
-            for (auto j = 0; j < MAX_PARTICLES; j++) {
-                if (i == j || !particles[j].enabled) continue;
-                Particle &a = particles[i];
-                Particle &b = particles[j];
-                // check if particles are intersection
-                if (dist(a.pos,b.pos) < (a.radius + b.radius)) {
-                    // check to make sure they're not already moving away from each other (helps with glitches)
-                    if (dist(a.pos, b.pos) > dist(a.pos + a.vel, b.pos + b.vel)) {
-                        double massA = 2 * b.mass / (a.mass + b.mass);
-                        double massB = 2 * a.mass / (a.mass + b.mass);
-                        Vec dif = a.pos - b.pos;
-                        double normalisedDotProduct = ((a.vel - b.vel) % dif) / (pow(abs(dif),2));
-
-                        Vec aNewVel = a.vel - massA * normalisedDotProduct * dif;
-                        Vec bNewVel = b.vel + massB * normalisedDotProduct * dif;
-
-                        a.vel = aNewVel;
-                        b.vel = bNewVel;
-
-                        collisionCallback(a.note + 33, clamp(abs(a.vel)/10), a.pos.x/500.0f - 1.0f);
-                        collisionCallback(b.note + 33, clamp(abs(b.vel)/10), b.pos.x/500.0f - 1.0f);
-
-                        a.lastCollided = 0;
-                        b.lastCollided = 0;
-                    }
-                }
-            }
-        }
+    void setOpeningAngle(double theta) {
+        openingAngle = theta;
+    }
+
+    void setLevelOfDetailThreshold(int particleCount) {
+        levelOfDetailThreshold = particleCount;
+    }
+
+    // Collision rates estimated by the last step; only 'active' if that step ran in level-of-detail mode
+    const CollisionRates &getCollisionRates() const {
+        return collisionRates;
+    }
+
+    // The geometry must outlive the simulation (or be replaced first); pass nullptr to remove all obstacles
+    void setStaticGeometry(const StaticGeometry *newGeometry) {
+        geometry = newGeometry;
     }
+
+
+    // Step the simulation. The callback takes a midi note, a clamped velocity and a pan value, followed by the index of
+    // the particle that rang and the one it hit (-1 for an obstacle). In level-of-detail mode
+    // only obstacle hits go through the callback, and particle collisions are summarised in getCollisionRates instead
+    void step(const std::function<void (int, float, float, int, int)> &collisionCallback, float timeScale = 1.0f);
 };
 
 
@@ -20,18 +20,77 @@
 
 #include <JuceHeader.h>
 #include "ParticleSimulation.h"
+#include "SimulationFrameBuffer.h"
 
-class ParticleSimulationVisualiser : public Component, private Timer {
+/** Draws the particles from the frames the audio thread publishes, interpolating between the last two so that motion
+ *  stays smooth whatever rate the frames arrive at. Drawing is always one frame interval behind the simulation, which
+ *  is what lets it land exactly on the newest frame just as the next one is due. Redraws are driven by the display
+ *  refresh where JUCE supports it, and skipped altogether when nothing has moved.
+ */
+class ParticleSimulationVisualiser : public Component
+#if JUCE_MAJOR_VERSION < 7
+    , private Timer
+#endif
+{
 private:
     const ParticleSimulation &sim;
+    SimulationFrameBuffer &frames;
     const StringArray noteNames = {"C","C#","D","D#","E","F","F#","G","G#","A","A#","B"};
+
+    // Frames further apart than this (e.g. either side of a silence) are just drawn as they are
+    static constexpr double MAX_INTERPOLATION_INTERVAL_MS = 100.0;
+    // A particle that moves further than this between frames has jumped (e.g. the chamber was put back to a
+    // checkpoint), so sliding it across would be wrong
+    static constexpr float MAX_INTERPOLATION_DISTANCE = 100.0f;
+
+    SimulationFrameBuffer::Frame previous;
+    SimulationFrameBuffer::Frame latest;
+    SimulationFrameBuffer::Frame incoming;
+
+    // How far between the previous and latest frames the last paint was, and which obstacles it drew
+    double paintedAlpha = 1.0;
+    const StaticGeometry *paintedGeometry = nullptr;
+
+    // Where each simulation slot is in the previous frame (or -1), for finding a particle's previous position. Only a
+    // particle with the same id is the same particle
+    std::vector<int> previousIndexBySlot;
+
+#if JUCE_MAJOR_VERSION >= 7
+    VBlankAttachment vBlank {this, [this] { update(); }};
+#else
+    void timerCallback() override {
+        update();
+    }
+#endif
+
+    double getAlpha() const {
+        const double interval = 1000.0 * double(latest.sampleTime - previous.sampleTime) / latest.sampleRate;
+        if (interval <= 0.0 || interval > MAX_INTERPOLATION_INTERVAL_MS) return 1.0;
+        return jlimit(0.0, 1.0, (SimulationFrameBuffer::now() - latest.publishedAt) / interval);
+    }
+
+    void update() {
+        bool changed = false;
+        if (frames.fetch(incoming)) {
+            std::swap(previous, latest);
+            std::swap(latest, incoming);
+            changed = true;
+        }
+        // Still part way between frames, or the obstacles have been switched
+        changed = changed || paintedAlpha < 1.0 || sim.geometry.load() != paintedGeometry;
+        if (changed) repaint();
+    }
+
 public:
-    ParticleSimulationVisualiser(const ParticleSimulation &sim): sim(sim) {
+    ParticleSimulationVisualiser(const ParticleSimulation &sim, SimulationFrameBuffer &frames): sim(sim), frames(frames) {
+        frames.setHasReader(true);
+#if JUCE_MAJOR_VERSION < 7
         startTimerHz(60);
+#endif
     }
 
-    void timerCallback() override {
-        repaint();
+    ~ParticleSimulationVisualiser() override {
+        frames.setHasReader(false);
     }
 
     String getNoteName(int note) {
@@ -42,30 +101,72 @@ public:
         return noteName;
     }
 
+    void paintObstacles(Graphics &g, const StaticGeometry &geometry) {
+        const float sx = getWidth() / 1000.0f;
+        const float sy = getHeight() / 1000.0f;
+        g.setColour(Colours::darkgrey.withAlpha(0.8f));
+        for (const auto & primitive : geometry.getPrimitives()) {
+            if (primitive.type == StaticGeometry::PrimitiveType::CIRCLE) {
+                float rx = float(primitive.radius) * sx;
+                float ry = float(primitive.radius) * sy;
+                g.fillEllipse(float(primitive.a.x) * sx - rx, float(primitive.a.y) * sy - ry, rx * 2, ry * 2);
+            } else {
+                g.drawLine(float(primitive.a.x) * sx, float(primitive.a.y) * sy,
+                           float(primitive.b.x) * sx, float(primitive.b.y) * sy, 3.0f);
+            }
+        }
+    }
+
     void paint(Graphics &g) override {
         g.fillAll(Colours::white.withAlpha(0.5f));
         g.setFont(g.getCurrentFont().withHeight(8));
 
-        // It is unclear from the JUCE documentation whether it's possible this could happen concurrently with an audio
-        // buffer filling operation. If so, the simulation should be locked while it is rendered, but I didn't want to
-        // add it pre-emptively because it could slow things down a little
+        // Layouts are only ever swapped, never changed, so the geometry doesn't need any more care than this
+        paintedGeometry = sim.geometry.load();
+        if (paintedGeometry != nullptr) {
+            paintObstacles(g, *paintedGeometry);
+        }
 
-        for (const auto & particle : sim.particles) {
-            if (particle.enabled) {
-                if (particle.lastCollided < 20) {
-                    g.setColour(Colour::fromHSL(particle.hue / 360.0f, 1.0f, (20.0f - particle.lastCollided) / 20.0f, 1.0f));
-                } else {
-                    g.setColour(Colours::black.withAlpha(0.5f));
+        for (auto i = 0; i < previous.numParticles; i++) {
+            const auto slot = size_t(previous.particles[size_t(i)].slot);
+            if (slot >= previousIndexBySlot.size()) previousIndexBySlot.resize(slot + 1, -1);
+            previousIndexBySlot[slot] = i;
+        }
+
+        const auto alpha = float(getAlpha());
+        const float sx = getWidth() / latest.width;
+        const float sy = getHeight() / latest.height;
+        for (auto i = 0; i < latest.numParticles; i++) {
+            const auto &particle = latest.particles[size_t(i)];
+            float px = particle.x;
+            float py = particle.y;
+            const auto slot = size_t(particle.slot);
+            if (alpha < 1.0f && slot < previousIndexBySlot.size() && previousIndexBySlot[slot] >= 0) {
+                const auto &before = previous.particles[size_t(previousIndexBySlot[slot])];
+                if (before.id == particle.id && std::hypot(particle.x - before.x, particle.y - before.y) < MAX_INTERPOLATION_DISTANCE) {
+                    px = before.x + alpha * (particle.x - before.x);
+                    py = before.y + alpha * (particle.y - before.y);
                 }
-                float x = particle.pos.x * (getWidth() / 1000.0);
-                float y = particle.pos.y * (getHeight() / 1000.0);
-                float rx = particle.radius * (getWidth() / 1000.0);
-                float ry = particle.radius * (getHeight() / 1000.0);
-                g.fillEllipse(x-rx, y-ry, rx *2, ry * 2);
-                g.setColour(Colours::white);
-                g.drawText(getNoteName(particle.note), int(x - rx), int(y - ry), int(rx * 2), int(ry * 2), Justification::centred, false);
             }
+
+            if (particle.lastCollided < 20) {
+                g.setColour(Colour::fromHSL(particle.hue / 360.0f, 1.0f, (20.0f - particle.lastCollided) / 20.0f, 1.0f));
+            } else {
+                g.setColour(Colours::black.withAlpha(0.5f));
+            }
+            float x = px * sx;
+            float y = py * sy;
+            float rx = particle.radius * sx;
+            float ry = particle.radius * sy;
+            g.fillEllipse(x-rx, y-ry, rx *2, ry * 2);
+            g.setColour(Colours::white);
+            g.drawText(getNoteName(particle.note), int(x - rx), int(y - ry), int(rx * 2), int(ry * 2), Justification::centred, false);
+        }
+
+        for (auto i = 0; i < previous.numParticles; i++) {
+            previousIndexBySlot[size_t(previous.particles[size_t(i)].slot)] = -1;
         }
+        paintedAlpha = alpha;
     }
 };
 
@@ -19,6 +19,8 @@
 #define PARTICLES_PLUGIN_PARTICLESYNTH_H
 
 #include <JuceHeader.h>
+#include "ResonatorBank.h"
+#include "GrainCloud.h"
 
 class ParticleSynth : public Synthesiser, public AudioProcessorValueTreeState::Listener {
 private:
@@ -146,6 +148,49 @@ private:
     };
 
     VoiceParams params;
+
+public:
+    // Voices gives every collision its own oscillator and envelope; Resonators strikes one shared resonator per note, so
+    // its cost doesn't grow with the collision rate
+    enum class Engine {
+        VOICES,
+        RESONATORS
+    };
+
+private:
+    std::atomic<Engine> engine {Engine::VOICES};
+    ResonatorBank resonators;
+
+    // Plays the simulation's estimated collision rates when it is in level-of-detail mode, alongside either engine
+    GrainCloud cloud;
+
+    // The resonator engine reads the same midi stream as the voices, so it has to keep track of the pan controller for
+    // each channel itself
+    float channelPan[16] = {};
+
+    void renderResonators(AudioBuffer<float> &outputBuffer, const MidiBuffer &midi, int startSample, int numSamples) {
+        auto l = outputBuffer.getWritePointer(0);
+        auto r = outputBuffer.getWritePointer(1);
+        auto position = startSample;
+        const auto end = startSample + numSamples;
+
+        for (const auto metadata : midi) {
+            auto eventPosition = jlimit(startSample, end, metadata.samplePosition);
+            resonators.render(l + position, r + position, eventPosition - position);
+            position = eventPosition;
+
+            const auto message = metadata.getMessage();
+            const auto channel = jlimit(0, 15, message.getChannel() - 1);
+            if (message.isController() && message.getControllerNumber() == ParticleVoice::PAN_CC) {
+                channelPan[channel] = (message.getControllerValue() / 64.0f) - 1.0f;
+            } else if (message.isNoteOn()) {
+                auto [lAmp, rAmp] = ParticleVoice::equalPower(channelPan[channel]);
+                resonators.strike(message.getNoteNumber(), message.getFloatVelocity(), lAmp, rAmp);
+            }
+        }
+        resonators.render(l + position, r + position, end - position);
+    }
+
 public:
     ParticleSynth() {
         addSound(new ParticleSound);
@@ -155,13 +200,68 @@ public:
         }
     }
 
+    void setCurrentPlaybackSampleRate(double sampleRate) override {
+        Synthesiser::setCurrentPlaybackSampleRate(sampleRate);
+        resonators.setSampleRate(float(sampleRate));
+        cloud.setSampleRate(float(sampleRate));
+    }
+
+    // Pass on the simulation's latest collision rate estimate, which is in triggers per simulation step
+    void setCloudRates(const CollisionRates &rates, float stepsPerSecond) {
+        cloud.setRates(rates, stepsPerSecond);
+    }
+
+    // Render with whichever engine is selected. The midi is the same for both, so this is a drop-in replacement for
+    // Synthesiser::renderNextBlock. Whatever the other engine was playing when it was switched away from is left to
+    // ring out, rather than being cut off or left hanging until it is switched back to
+    void render(AudioBuffer<float> &outputBuffer, const MidiBuffer &midi, int startSample, int numSamples) {
+        const MidiBuffer noMidi;
+        const auto selected = engine.load();
+        if (selected == Engine::VOICES || !voicesSilent()) {
+            renderNextBlock(outputBuffer, selected == Engine::VOICES ? midi : noMidi, startSample, numSamples);
+        }
+        if (selected == Engine::RESONATORS || !resonators.isSilent()) {
+            renderResonators(outputBuffer, selected == Engine::RESONATORS ? midi : noMidi, startSample, numSamples);
+        }
+        cloud.render(outputBuffer.getWritePointer(0, startSample), outputBuffer.getWritePointer(1, startSample), numSamples);
+    }
+
+    bool voicesSilent() const {
+        for (auto i = 0; i < getNumVoices(); i++) {
+            if (getVoice(i)->isVoiceActive()) return false;
+        }
+        return true;
+    }
+
+    // True once every voice and resonator has finished ringing, so there's nothing left to render
+    bool isSilent() const {
+        return resonators.isSilent() && cloud.isSilent() && voicesSilent();
+    }
+
+    // How long a note can keep sounding after it is triggered with the current settings
+    double getTailLengthSeconds() const {
+        if (engine == Engine::RESONATORS) {
+            return resonators.getTailLengthSeconds();
+        }
+        // A voice decays exponentially from full scale down to 0.01 (log2(100) half-lives), and then fades out
+        // linearly over a few more blocks, which the extra half-life comfortably covers
+        return params.attackTime + params.decayHalfLife * (std::log2(100.0) + 1.0);
+    }
+
     void parameterChanged (const String& parameterID, float newValue) override {
         if (parameterID == "attack_time") {
             params.attackTime = newValue;
+            cloud.setAttackTime(newValue);
         } else if (parameterID == "decay_half_life") {
             params.decayHalfLife = newValue;
+            resonators.setDecayHalfLife(newValue);
+            cloud.setDecayHalfLife(newValue);
         } else if (parameterID == "waveform") {
             params.waveform = newValue;
+            resonators.setWaveform(newValue);
+            cloud.setWaveform(newValue);
+        } else if (parameterID == "engine") {
+            engine = newValue < 0.5f ? Engine::VOICES : Engine::RESONATORS;
         }
     }
 };
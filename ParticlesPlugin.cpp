@@ -21,6 +21,12 @@
 #include "ParticleSimulation.h"
 #include "ParticleSimulationVisualiser.h"
 #include "ParticleSynth.h"
+#include "TriggerCoalescer.h"
+#include "CollisionTrace.h"
+#include "SimulationCheckpoints.h"
+#include "TimelineTrace.h"
+#include "SharedStatePublisher.h"
+#include "SimulationFrameBuffer.h"
 #include "BasicStereoSynthPlugin.h"
 
 namespace Params {
@@ -34,17 +40,37 @@ namespace Params {
     StrConst ORIGIN = "particle_origin";
     StrConst SCALE = "scale";
     StrConst SIZE_BY_NOTE = "size_by_note";
-
-    StringArray all() {
+    StrConst OBSTACLES = "obstacles";
+    StrConst ATTRACTION = "attraction";
+    StrConst OPENING_ANGLE = "opening_angle";
+    StrConst COALESCE = "coalesce_window";
+    StrConst ENGINE = "engine";
+    StrConst CAPACITY = "max_particles";
+    StrConst LOD_THRESHOLD = "lod_threshold";
+
+    // Parameters are grouped by section so the editor can lay each group out under its own heading
+    StringArray simulation() {
         return {
             MULTIPLIER,
             ORIGIN,
             GRAVITY,
             SCALE,
             SIZE_BY_NOTE,
+            OBSTACLES,
+            ATTRACTION,
+            OPENING_ANGLE,
+            CAPACITY,
+            LOD_THRESHOLD,
+        };
+    }
+
+    StringArray synthesis() {
+        return {
+            ENGINE,
             WAVEFORM,
             ATTACK,
             DECAY,
+            COALESCE,
             MASTER,
         };
     }
@@ -58,6 +84,26 @@ namespace Params {
             return {TOP_LEFT, TOP_RANDOM, RANDOM_INSIDE, RANDOM_OUTSIDE};
         }
     }
+
+    namespace Obstacles {
+        StrConst NONE = "None";
+        StrConst CENTRE_POST = "Centre Post";
+        StrConst PEGBOARD = "Pegboard";
+        StrConst FUNNEL = "Funnel";
+        StrConst PRISM = "Prism";
+        StringArray all() {
+            return {NONE, CENTRE_POST, PEGBOARD, FUNNEL, PRISM};
+        }
+    }
+
+    // Order matters here, as the synth maps the choice index straight onto its Engine enum
+    namespace Engine {
+        StrConst VOICES = "Voices";
+        StrConst RESONATORS = "Resonators";
+        StringArray all() {
+            return {VOICES, RESONATORS};
+        }
+    }
 }
 
 
@@ -78,18 +124,80 @@ inline auto param(const String& pid, const String& name, bool def) {
 
 
 
-class ParticlesAudioProcessor : public BasicStereoSynthPlugin, public AudioProcessorValueTreeState::Listener  {
+class ParticlesAudioProcessor : public BasicStereoSynthPlugin, public AudioProcessorValueTreeState::Listener, private AsyncUpdater  {
 private:
     friend class ParticlesPluginEditor;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ParticlesAudioProcessor)
 
     const int samplesPerSimulationStep = 64;
 
+    // Upper end of the capacity parameter, which anything that copies particles out is sized for
+    static constexpr int MAX_PARTICLES = 10000;
+
     ParticleSynth synth;
     ParticleSimulation sim;
 
     // Keep track of samples so we know when to step the simulation
-    int sampleStepCounter = 0;
+    int samplesUntilNextStep = samplesPerSimulationStep;
+
+    // Running count of samples processed, so that triggers can be timed across block boundaries
+    int64 sampleClock = 0;
+
+    // Sits between the simulation and the synth, folding together repeated hits on the same note
+    TriggerCoalescer coalescer;
+
+    // While the host is playing, the simulation is checkpointed every few steps along its timeline, and wherever
+    // playback starts (e.g. the start of a loop), so that when the host comes back the chamber can be put back how it
+    // was rather than carrying on from wherever it had got to
+    static constexpr int64 CHECKPOINT_INTERVAL_TICKS = 8;
+    // Catching up from a checkpoint happens all at once on the audio thread, so it has to stay to a few steps
+    static constexpr int64 MAX_FAST_FORWARD_TICKS = CHECKPOINT_INTERVAL_TICKS;
+    // The regular checkpoints cover this much of the most recently played timeline, which is enough to come back
+    // exactly the first time round a short loop. Big chambers get less, so as not to go over a particle budget
+    static constexpr double CHECKPOINT_HISTORY_SECONDS = 1.0;
+    static constexpr int CHECKPOINT_PARTICLE_BUDGET = 1 << 17;
+    static constexpr int MIN_CHECKPOINTS = 16;
+    // The places playback started from are kept apart from the rest, so that a loop longer than the history above
+    // still comes back to its start from the second time round on
+    static constexpr int START_CHECKPOINTS = 8;
+
+    // Only allocated once the transport has run, since most instances never see it, and replaced (when the capacity
+    // or sample rate changes) while holding the callback lock, like the trace objects below
+    std::unique_ptr<SimulationCheckpoints> checkpoints;
+    std::unique_ptr<SimulationCheckpoints> startCheckpoints;
+    std::atomic<bool> checkpointsWanted {false};
+    double checkpointSampleRate = 0.0;
+
+    // Where the host timeline should be at the start of the next block if it keeps playing, or -1 if it isn't
+    int64 expectedTimelinePosition = -1;
+
+    // Optional capture of everything going into and coming out of the simulation, and replay of a capture in place of
+    // the physics. These are only swapped while holding the callback lock, so they never change during a block
+    std::unique_ptr<CollisionTrace::Writer> traceWriter;
+    std::unique_ptr<CollisionTrace::Reader> traceReplay;
+    int64 traceRecordingStart = 0;
+    int64 traceReplayStart = 0;
+    // Whether the last cloud rates recorded were playing, so that the step the cloud stops on gets recorded too
+    bool traceCloudActive = false;
+    // The cloud rates being rebuilt from a trace's CLOUD_STEP and CLOUD_RATE records
+    CollisionRates replayCloudRates;
+
+    // Whether this instance started the (process-wide) timeline trace, and so should finish it
+    bool ownsTimelineTrace = false;
+
+    // Optional export of the particles to shared memory for an external renderer. Swapped under the callback lock
+    std::unique_ptr<SharedStatePublisher> sharedState;
+    // Nothing can usefully draw faster than this, and copying out a big chamber every step would add up
+    static constexpr double SHARED_STATE_RATE_HZ = 120.0;
+    int64 nextSharedStatePublish = 0;
+    // How many numbered names to try before giving up, when other instances (in this process or others) have the first
+    static constexpr int MAX_SHARED_STATE_NAMES = 64;
+
+    // Snapshots for the editor's view, which interpolates between them, so they can come less often than it redraws.
+    // Sized for the current capacity, and resized along with the checkpoints
+    SimulationFrameBuffer visualFrames {ParticleSimulation::DEFAULT_CAPACITY};
+    static constexpr double VISUAL_FRAME_RATE_HZ = 60.0;
+    int64 nextVisualFramePublish = 0;
 
     // Duration in seconds between note on and note off. This is useful primarily when taking the midi side output and
     // using with another synth
@@ -110,10 +218,23 @@ private:
             param(Params::ATTACK, "Attack Time(s)", {0.001f, 0.1f, 0.001f}, 0.01f),
             param(Params::DECAY, "Decay half-life(s)", {0.001f, 0.5f, 0.001f}, 0.05f),
             param(Params::MASTER, "Master Volume (dB)", {-12.0f, 3.0f, 0.01f}, 0.0f),
+            param(Params::COALESCE, "Coalesce Window (ms)", {0.0f, 50.0f, 0.1f}, 5.0f),
             param(Params::WAVEFORM, "Sin->Saw", {0.0f, 1.0f, 0.01f}, 0.0f),
             param(Params::ORIGIN, "Particle Origin" , Params::Origin::all(), Params::Origin::RANDOM_INSIDE),
             param(Params::SCALE, "Particle Scale Factor", {0.1f, 2.0f, 0.01f}, 1.0f),
-            param(Params::SIZE_BY_NOTE, "Note->Size", true)
+            param(Params::SIZE_BY_NOTE, "Note->Size", true),
+            param(Params::OBSTACLES, "Obstacles", Params::Obstacles::all(), Params::Obstacles::NONE),
+            param(Params::ATTRACTION, "Attraction", {-1.0f, 1.0f, 0.01f}, 0.0f),
+            // Trades accuracy of the attraction for speed: 0 is exact (and slow), bigger lumps more of the far away
+            // particles together
+            param(Params::OPENING_ANGLE, "Opening Angle", {0.0f, 1.5f, 0.01f}, 0.5f),
+            param(Params::ENGINE, "Synth Engine", Params::Engine::all(), Params::Engine::VOICES),
+            // The exact collision pass is quadratic in the particle count, so only the level-of-detail mode (see
+            // LOD_THRESHOLD) keeps up towards the top of this range; exact mode runs out of time at around 700
+            param(Params::CAPACITY, "Max Particles", {50.0f, float(MAX_PARTICLES), 1.0f, 0.3f}, float(ParticleSimulation::DEFAULT_CAPACITY)),
+            // Exact mode costs about 0.4ms per step at 400 particles against a budget of about 1.45ms (64 samples at
+            // 44.1kHz), and it grows with the square of the count, so the default leaves plenty of headroom
+            param(Params::LOD_THRESHOLD, "Cloud Above (particles)", {100.0f, float(MAX_PARTICLES), 1.0f, 0.3f}, 400.0f)
         }
     };
 
@@ -125,9 +246,72 @@ private:
             {Params::Origin::TOP_LEFT, ParticleOrigin::TOP_LEFT}
     };
 
+    // Resizing the simulation allocates, so parameter changes (which may arrive on the audio thread) are passed over to
+    // the message thread to do it
+    std::atomic<int> requestedCapacity {ParticleSimulation::DEFAULT_CAPACITY};
+
+    // Every obstacle layout is built up front, so switching between them is just a pointer swap in the simulation
+    std::map<String, StaticGeometry> obstacleLayouts;
+
     // Keep well-typed pointers to non-float parameters to avoid messy dynamic_casts in the parameterChanged function
     AudioParameterChoice *particleOrigin;
     AudioParameterBool *sizeByNote;
+    AudioParameterChoice *obstacles;
+
+    void createObstacleLayouts() {
+        obstacleLayouts[Params::Obstacles::NONE] = {};
+
+        obstacleLayouts[Params::Obstacles::CENTRE_POST].addCircle({500, 500}, 80);
+
+        auto &pegboard = obstacleLayouts[Params::Obstacles::PEGBOARD];
+        for (auto row = 0; row < 5; row++) {
+            for (auto column = 0; column < 7; column++) {
+                double offset = (row % 2) * 62.5;
+                pegboard.addCircle({125.0 + column * 125.0 + offset - 31.25, 200.0 + row * 150.0}, 15);
+            }
+        }
+
+        auto &funnel = obstacleLayouts[Params::Obstacles::FUNNEL];
+        funnel.addSegment({100, 300}, {440, 650});
+        funnel.addSegment({900, 300}, {560, 650});
+
+        obstacleLayouts[Params::Obstacles::PRISM].addPolygon({{500, 330}, {650, 630}, {350, 630}});
+    }
+
+    // Turn a single trigger into the pan, note on and note off messages that the synth (and midi output) understands
+    void addTriggerEvents(MidiBuffer &events, int midiNote, float velocity, float pan, int position, int noteLengthSamples) {
+        TRACE_SCOPE("trigger events");
+        // Cycle round all 16 channels, allowing up to 16 copies of the same note playing simultanously
+        lastChannelForNote[midiNote] = (lastChannelForNote[midiNote] + 1) % 16;
+
+        // MidiMessage understanding of 'channel' is 1-based, not 0-based
+        int ch = lastChannelForNote[midiNote] + 1;
+
+        events.addEvent(MidiMessage::controllerEvent(ch, 10, static_cast<int>((pan + 1.0f)*64.0f)), position);
+        events.addEvent(MidiMessage::noteOn(ch, midiNote,velocity), position);
+        events.addEvent(MidiMessage::noteOff(ch, midiNote), position + noteLengthSamples);
+    }
+
+    void recordTrace(CollisionTrace::RecordType type, int64 time, int note, float velocity, float pan, int particle, int other) {
+        if (traceWriter != nullptr) {
+            traceWriter->record({time - traceRecordingStart, velocity, pan, particle, other, type, static_cast<uint8>(note), {}});
+        }
+    }
+
+    // Only bins with something in them are written, since a whole table for every step would soon add up
+    void recordCloudRates(int64 time, const CollisionRates &rates) {
+        if (traceWriter == nullptr || (!rates.active && !traceCloudActive)) return;
+        traceCloudActive = rates.active;
+        recordTrace(CollisionTrace::RecordType::CLOUD_STEP, time, 0, 0.0f, 0.0f, rates.active ? 1 : 0, -1);
+        if (!rates.active) return;
+        for (auto note = 0; note < CollisionRates::NUM_NOTES; note++) {
+            for (auto region = 0; region < CollisionRates::NUM_REGIONS; region++) {
+                if (rates.rate[note][region] <= 0.0f) continue;
+                recordTrace(CollisionTrace::RecordType::CLOUD_RATE, time, note, rates.velocity[note][region],
+                            rates.rate[note][region], -1, region);
+            }
+        }
+    }
 
     void addStateListeners(AudioProcessorValueTreeState::Listener * listener, const StringArray& parameters) {
         for (auto &p: parameters) {
@@ -137,28 +321,42 @@ private:
 
 public:
     ParticlesAudioProcessor(): BasicStereoSynthPlugin("Particles") {
+        createObstacleLayouts();
 
         addStateListeners(this, {
                 Params::MULTIPLIER,
                 Params::GRAVITY,
                 Params::ORIGIN,
                 Params::SIZE_BY_NOTE,
-                Params::SCALE
+                Params::SCALE,
+                Params::OBSTACLES,
+                Params::ATTRACTION,
+                Params::OPENING_ANGLE,
+                Params::CAPACITY,
+                Params::LOD_THRESHOLD
         });
 
         addStateListeners(&synth, {
                 Params::ATTACK,
                 Params::DECAY,
-                Params::WAVEFORM
+                Params::WAVEFORM,
+                Params::ENGINE
         });
 
         // ideally we wouldn't have to cast at all, but the AudioProcessorValueStateTree stores everything as a
         // RangedAudioParameter* so we cast here to fail fast if we fuck up rather than crash in the change handler
         particleOrigin = dynamic_cast<AudioParameterChoice*>(state.getParameter(Params::ORIGIN));
         sizeByNote = dynamic_cast<AudioParameterBool*>(state.getParameter(Params::SIZE_BY_NOTE));
+        obstacles = dynamic_cast<AudioParameterChoice*>(state.getParameter(Params::OBSTACLES));
+
+        // The simulation has level-of-detail switched off unless told otherwise, which doesn't match our default
+        sim.setLevelOfDetailThreshold(static_cast<int>(getParameterValue(Params::LOD_THRESHOLD)));
     }
 
-    ~ParticlesAudioProcessor() override = default;
+    ~ParticlesAudioProcessor() override {
+        cancelPendingUpdate();
+        if (ownsTimelineTrace) TimelineTrace::stop();
+    }
 
     AudioProcessorValueTreeState & parameterState() override { return state; }
 
@@ -174,16 +372,281 @@ public:
             sim.setSizeByNote(sizeByNote->get());
         } else if (parameterID == Params::SCALE) {
             sim.setScale(newValue);
+        } else if (parameterID == Params::OBSTACLES) {
+            auto choice = obstacles->getCurrentChoiceName();
+            sim.setStaticGeometry(&obstacleLayouts[choice]);
+        } else if (parameterID == Params::ATTRACTION) {
+            sim.setAttraction(newValue);
+        } else if (parameterID == Params::OPENING_ANGLE) {
+            sim.setOpeningAngle(newValue);
+        } else if (parameterID == Params::LOD_THRESHOLD) {
+            sim.setLevelOfDetailThreshold(static_cast<int>(newValue));
+        } else if (parameterID == Params::CAPACITY) {
+            requestedCapacity = static_cast<int>(newValue);
+            triggerAsyncUpdate();
+        }
+    }
+
+    // Set by prepareToPlay, for the message thread to check the developer hooks (see startDeveloperHooks)
+    std::atomic<bool> developerHooksDue {false};
+
+    // Everything that has to be resized to match the capacity is resized here, on the message thread, since that's
+    // where the simulation's old arenas are freed and where the editor reads the view's frames
+    void handleAsyncUpdate() override {
+        const int capacity = requestedCapacity;
+        if (sim.getCapacity() != capacity) {
+            sim.setCapacity(capacity);
+        }
+        // Checkpoints need room for a full chamber. Resizing them loses the old ones, but that only costs the next seek
+        // (prepareToPlay can drop them from another thread, hence looking under the lock)
+        const auto sampleRate = getSampleRate();
+        auto checkpointsNeeded = [&] {
+            const ScopedLock lock(getCallbackLock());
+            return checkpointsWanted && sampleRate > 0.0
+                   && (checkpoints == nullptr || checkpoints->getParticleCapacity() != capacity);
+        };
+        if (checkpointsNeeded()) {
+            const auto interval = double(CHECKPOINT_INTERVAL_TICKS * samplesPerSimulationStep);
+            const auto history = int(std::ceil(CHECKPOINT_HISTORY_SECONDS * sampleRate / interval));
+            const auto count = jmax(MIN_CHECKPOINTS, jmin(history, CHECKPOINT_PARTICLE_BUDGET / capacity));
+            auto resized = std::make_unique<SimulationCheckpoints>(count, capacity);
+            auto resizedStarts = std::make_unique<SimulationCheckpoints>(START_CHECKPOINTS, capacity);
+            const ScopedLock lock(getCallbackLock());
+            if (checkpointsWanted) {
+                checkpoints.swap(resized);
+                startCheckpoints.swap(resizedStarts);
+            }
         }
+        // The same goes for the view's frames, except that only the frame in flight is lost
+        if (visualFrames.getMaxParticles() != capacity) {
+            SimulationFrameBuffer::Storage storage(capacity);
+            const ScopedLock lock(getCallbackLock());
+            visualFrames.swapStorage(storage);
+        }
+        if (developerHooksDue.exchange(false)) startDeveloperHooks();
     }
 
     void prepareToPlay (double sampleRate, int samplesPerBlock) override {
         synth.setCurrentPlaybackSampleRate(sampleRate);
+        coalescer.reset();
+
+        // Hosts call this from all sorts of threads, so any resizing still to do (and the developer hooks) is left to the
+        // message thread. If we're already on it, it may as well happen now rather than after the first few blocks
+        developerHooksDue = true;
+        triggerAsyncUpdate();
+        if (MessageManager::existsAndIsCurrentThread()) handleUpdateNowIfNeeded();
+
+        // Positions are in samples, so checkpoints from another sample rate are at the wrong places, and there'd be the
+        // wrong number of them. They're dropped, to be made again once the transport runs at the new rate. At the same
+        // rate they are kept, so that an offline bounce can start from where playback left the chamber
+        if (sampleRate != checkpointSampleRate) {
+            std::unique_ptr<SimulationCheckpoints> stale, staleStarts;
+            const ScopedLock lock(getCallbackLock());
+            stale.swap(checkpoints);
+            staleStarts.swap(startCheckpoints);
+            checkpointsWanted = false;
+            checkpointSampleRate = sampleRate;
+        }
+        expectedTimelinePosition = -1;
+    }
+
+    // Developer hooks, so that a trace can be captured or replayed in any host without needing any UI for it. These
+    // are checked on the message thread once the processor has been prepared
+    void startDeveloperHooks() {
+        auto recordPath = SystemStats::getEnvironmentVariable("PARTICLES_TRACE_RECORD", {});
+        if (recordPath.isNotEmpty() && traceWriter == nullptr) {
+            startTraceRecording(File(recordPath));
+        }
+        auto replayPath = SystemStats::getEnvironmentVariable("PARTICLES_TRACE_REPLAY", {});
+        if (replayPath.isNotEmpty() && traceReplay == nullptr) {
+            startTraceReplay(File(replayPath));
+        }
+        auto timelinePath = SystemStats::getEnvironmentVariable("PARTICLES_TIMELINE_TRACE", {});
+        if (timelinePath.isNotEmpty() && !ownsTimelineTrace) {
+            // Only the first instance to get here starts it; start() turns the rest away
+            ownsTimelineTrace = TimelineTrace::start(timelinePath.toRawUTF8());
+        }
+        auto sharedStateName = SystemStats::getEnvironmentVariable("PARTICLES_SHARED_STATE", {});
+        if (sharedStateName.isNotEmpty() && sharedState == nullptr) {
+            startSharedStateExport(sharedStateName);
+        }
+    }
+
+    // Start streaming note input and collisions to a trace file. Call from the message thread
+    bool startTraceRecording(const File &file) {
+        auto writer = std::make_unique<CollisionTrace::Writer>();
+        if (!writer->start(file, getSampleRate())) return false;
+        const ScopedLock lock(getCallbackLock());
+        traceWriter.swap(writer);
+        traceRecordingStart = sampleClock;
+        traceCloudActive = false;
+        return true;
+    }
+
+    void stopTraceRecording() {
+        std::unique_ptr<CollisionTrace::Writer> finished;
+        const ScopedLock lock(getCallbackLock());
+        finished.swap(traceWriter);
+    }
+
+    // Drive the synth from the collisions in a trace file instead of running the simulation. Call from the message thread
+    bool startTraceReplay(const File &file) {
+        auto reader = std::make_unique<CollisionTrace::Reader>();
+        // Times in the trace are in samples, so replaying at a different rate would play it back at the wrong speed
+        if (!reader->open(file) || reader->getSampleRate() != getSampleRate()) return false;
+        const ScopedLock lock(getCallbackLock());
+        traceReplay.swap(reader);
+        traceReplayStart = sampleClock;
+        replayCloudRates.clear();
+        return true;
+    }
+
+    void stopTraceReplay() {
+        std::unique_ptr<CollisionTrace::Reader> finished;
+        const ScopedLock lock(getCallbackLock());
+        finished.swap(traceReplay);
+    }
+
+    /** Publish the particles into a named shared memory region for drawing in another process. The name as given (e.g.
+     *  "/particles") is used if it's free, and otherwise the first free numbered one ("/particles-2" and so on), since
+     *  other instances, even in other hosts, may already be publishing. The name used can be found with
+     *  getSharedStateName. The region has room for the largest chamber the capacity parameter allows. Call from the
+     *  message thread */
+    bool startSharedStateExport(const String &baseName) {
+        auto publisher = std::make_unique<SharedStatePublisher>();
+        bool opened = false;
+        for (auto number = 1; number <= MAX_SHARED_STATE_NAMES && !opened; number++) {
+            const auto name = number == 1 ? baseName : baseName + "-" + String(number);
+            opened = publisher->open(name.toRawUTF8(), MAX_PARTICLES);
+        }
+        if (!opened) return false;
+        const ScopedLock lock(getCallbackLock());
+        sharedState.swap(publisher);
+        nextSharedStatePublish = sampleClock;
+        return true;
+    }
+
+    // Name of the region being published to, or empty if there isn't one. Message thread only
+    String getSharedStateName() const {
+        return sharedState != nullptr ? String(sharedState->getName()) : String();
+    }
+
+    void stopSharedStateExport() {
+        std::unique_ptr<SharedStatePublisher> finished;
+        const ScopedLock lock(getCallbackLock());
+        finished.swap(sharedState);
     }
     void releaseResources() override {}
 
+    // Host timeline position at the start of this block in samples, or -1 if the transport isn't running
+    int64 getTimelinePosition() {
+        auto playHead = getPlayHead();
+        if (playHead == nullptr) return -1;
+#if JUCE_MAJOR_VERSION >= 7
+        auto position = playHead->getPosition();
+        if (!position.hasValue() || !position->getIsPlaying() || !position->getTimeInSamples().hasValue()) return -1;
+        return std::max(int64(-1), *position->getTimeInSamples());
+#else
+        AudioPlayHead::CurrentPositionInfo position;
+        if (!playHead->getCurrentPosition(position) || !position.isPlaying) return -1;
+        return std::max(int64(-1), position.timeInSamples);
+#endif
+    }
+
+    float getSimulationTimeScale() const {
+        // The simuation is coded with an assumption of 256 samples per step, so if we configure a different
+        // precision here we need to apply a scaling factor
+        return float(samplesPerSimulationStep) / 256.0f;
+    }
+
+    void checkpointIfDue(int64 tick) {
+        if (checkpoints != nullptr && tick % CHECKPOINT_INTERVAL_TICKS == 0) {
+            checkpoints->save(tick * samplesPerSimulationStep, sim);
+        }
+    }
+
+    /** The host has started playing, looped or jumped. Line the simulation steps up with ticks on its timeline, and if
+     *  we've been at or just before this point before, restore that checkpoint and catch up to where we are. Input
+     *  between the checkpoint and the new position is lost when catching up, but input from the new position on is
+     *  sent by the host as normal. Checkpoints are positions in samples: the state before anything at or after that
+     *  sample happened */
+    void seekTo(int64 timelinePosition) {
+        const int64 nextTick = (timelinePosition + samplesPerSimulationStep - 1) / samplesPerSimulationStep;
+        samplesUntilNextStep = int(nextTick * samplesPerSimulationStep - timelinePosition);
+
+        if (checkpoints == nullptr) {
+            // The first time the transport runs, ask for somewhere to keep checkpoints from now on
+            if (!checkpointsWanted.exchange(true)) triggerAsyncUpdate();
+            return;
+        }
+        if (traceReplay != nullptr) return;
+        TRACE_SCOPE("checkpoint restore");
+        // Whichever of the two sets has the later checkpoint gets to restore it
+        const auto window = MAX_FAST_FORWARD_TICKS * samplesPerSimulationStep;
+        auto &source = startCheckpoints->findNearest(timelinePosition, window)
+                       >= checkpoints->findNearest(timelinePosition, window) ? *startCheckpoints : *checkpoints;
+        const auto restored = source.restoreNearest(timelinePosition, window, sim);
+        if (restored >= 0) {
+            // Anything waiting to sound came from the timeline we just left
+            coalescer.reset();
+            overflowBuffer.clear();
+            const int64 firstTick = (restored + samplesPerSimulationStep - 1) / samplesPerSimulationStep;
+            for (auto tick = firstTick; tick < nextTick; tick++) {
+                sim.step([] (int, float, float, int, int) {}, getSimulationTimeScale());
+            }
+        }
+
+        // Keep the state we're starting from, so that coming back here (every time round a loop, say) starts the same
+        if (restored != timelinePosition) {
+            startCheckpoints->save(timelinePosition, sim);
+        }
+    }
+
+    void publishFramesIfDue(int64 time) {
+        if (time >= nextVisualFramePublish) {
+            visualFrames.publish(sim, time, getSampleRate());
+            nextVisualFramePublish = time + int64(getSampleRate() / VISUAL_FRAME_RATE_HZ);
+        }
+        if (sharedState != nullptr && time >= nextSharedStatePublish) {
+            sharedState->publish(sim, time, getSampleRate());
+            nextSharedStatePublish = time + int64(getSampleRate() / SHARED_STATE_RATE_HZ);
+        }
+    }
+
+    // Nothing is held, nothing is waiting to be triggered and every voice has died away
+    bool isIdle() const {
+        return overflowBuffer.isEmpty() && coalescer.isEmpty() && sim.isIdle() && synth.isSilent()
+               && (traceReplay == nullptr || traceReplay->isFinished());
+    }
+
     void processBlock (AudioBuffer<float>& audio, MidiBuffer& midiInput) override {
+        TRACE_SCOPE("processBlock");
         int maximumMidiFutureInSamples = 40000;
+        const int numSamples = audio.getNumSamples();
+
+        const auto timelinePosition = getTimelinePosition();
+        if (timelinePosition >= 0 && timelinePosition != expectedTimelinePosition) {
+            seekTo(timelinePosition);
+        }
+        expectedTimelinePosition = timelinePosition >= 0 ? timelinePosition + numSamples : -1;
+
+        // Most instances in a big session spend most of their time doing nothing, so skip all the work when there's no
+        // input and nothing left ringing. Clearing the buffer also flags it as silent (AudioBuffer::hasBeenCleared)
+        // for anything downstream that checks
+        if (midiInput.isEmpty() && isIdle()) {
+            // The steps being skipped would do nothing, but they still have to stay in line with the timeline, and an
+            // empty chamber is as worth checkpointing as a full one
+            for (auto offset = samplesUntilNextStep; offset < numSamples; offset += samplesPerSimulationStep) {
+                if (timelinePosition >= 0) checkpointIfDue((timelinePosition + offset) / samplesPerSimulationStep);
+                samplesUntilNextStep += samplesPerSimulationStep;
+            }
+            samplesUntilNextStep -= numSamples;
+            // Keep publishing, so that readers see the chamber empty and can tell we're still here
+            publishFramesIfDue(sampleClock);
+            sampleClock += audio.getNumSamples();
+            audio.clear();
+            return;
+        }
 
         MidiBuffer simulationMidiEvents;
 
@@ -193,52 +656,115 @@ public:
         auto nextMidiEvent = midiInput.findNextSamplePosition(0);
         int noteLengthSamples = int(noteLength * getSampleRate());
 
-        for (auto i = 0; i < audio.getNumSamples(); i++) {
+        coalescer.setWindow(int64(getParameterValue(Params::COALESCE) * 0.001f * getSampleRate()));
+        const auto blockStart = sampleClock;
+        auto emitTrigger = [&] (int midiNote, float velocity, float pan, int64 time) {
+            // Nothing should be due before this block, but if it is it sounds straight away rather than getting lost
+            auto position = static_cast<int>(std::max(time, blockStart) - blockStart);
+            addTriggerEvents(simulationMidiEvents, midiNote, velocity, pan, position, noteLengthSamples);
+        };
+
+        // Rather than visiting every sample, the block is cut into segments at incoming midi events and simulation
+        // steps, since those are the only points where anything needs to happen
+        int position = 0;
+
+        // When replaying, the recorded collisions stand in for the simulation, and midi input is ignored
+        if (traceReplay != nullptr) {
+            position = numSamples;
+            bool cloudChanged = false;
+            traceReplay->readUntil(blockStart + numSamples - traceReplayStart, [&] (const CollisionTrace::Record &record) {
+                if (record.type == CollisionTrace::RecordType::CLOUD_STEP) {
+                    replayCloudRates.clear();
+                    replayCloudRates.active = record.particle != 0;
+                    cloudChanged = true;
+                    return;
+                }
+                if (record.type == CollisionTrace::RecordType::CLOUD_RATE) {
+                    if (record.note < CollisionRates::NUM_NOTES && record.other >= 0 && record.other < CollisionRates::NUM_REGIONS) {
+                        replayCloudRates.rate[record.note][record.other] = record.pan;
+                        replayCloudRates.velocity[record.note][record.other] = record.velocity;
+                    }
+                    return;
+                }
+                if (record.type != CollisionTrace::RecordType::COLLISION) return;
+                auto time = record.sampleTime + traceReplayStart;
+                coalescer.flush(time, emitTrigger);
+                coalescer.add(record.note, record.velocity, record.pan, time, emitTrigger);
+            });
+            // Live, the synth only hears the rates from the last step in the block, so the same goes for replay
+            if (cloudChanged) synth.setCloudRates(replayCloudRates, float(getSampleRate() / samplesPerSimulationStep));
+        }
+
+        while (position < numSamples) {
+
+            // Steps line up with ticks on the timeline while the host is playing (see seekTo). The checkpoint is taken
+            // before any input at the same sample, since the host will send that input again if it comes back here
+            if (samplesUntilNextStep <= 0 && timelinePosition >= 0) {
+                checkpointIfDue((timelinePosition + position) / samplesPerSimulationStep);
+            }
 
             // Process midi input to add/remove particles from the simulation
-            while (nextMidiEvent != midiInput.end() && (*nextMidiEvent).samplePosition <= i) {
+            while (nextMidiEvent != midiInput.end() && (*nextMidiEvent).samplePosition <= position) {
+                TRACE_SCOPE("midi input");
                 const auto &event = (*nextMidiEvent);
                 if (event.getMessage().isNoteOn()) {
                     sim.addNote(event.getMessage().getNoteNumber(), event.getMessage().getFloatVelocity());
+                    recordTrace(CollisionTrace::RecordType::NOTE_ON, blockStart + position, event.getMessage().getNoteNumber(),
+                                event.getMessage().getFloatVelocity(), 0.0f, -1, -1);
                 } else if (event.getMessage().isNoteOff()) {
                     sim.removeNote(event.getMessage().getNoteNumber());
+                    recordTrace(CollisionTrace::RecordType::NOTE_OFF, blockStart + position, event.getMessage().getNoteNumber(),
+                                0.0f, 0.0f, -1, -1);
                 }
                 nextMidiEvent++;
             }
 
             // Step simulation when appropriate to produce midi data to feed to the synthesiser
-            if (sampleStepCounter++ >= samplesPerSimulationStep) {
-
-                // The simuation is coded with an assumption of 256 samples per step, so if we configure a different
-                // precision here we need to apply a scaling factor
-                float simulationTimeScale = float(samplesPerSimulationStep) / 256.0f;
-
-                sim.step([&] (int midiNote, float velocity, float pan) {
-
-                    // Cycle round all 16 channels, allowing up to 16 copies of the same note playing simultanously
-                    lastChannelForNote[midiNote] = (lastChannelForNote[midiNote] + 1) % 16;
+            if (samplesUntilNextStep <= 0) {
+
+                sim.step([&] (int midiNote, float velocity, float pan, int particle, int other) {
+                    recordTrace(CollisionTrace::RecordType::COLLISION, blockStart + position, midiNote, velocity, pan, particle, other);
+                    coalescer.add(midiNote, velocity, pan, blockStart + position, emitTrigger);
+                }, getSimulationTimeScale());
+                recordCloudRates(blockStart + position, sim.getCollisionRates());
+                synth.setCloudRates(sim.getCollisionRates(), float(getSampleRate() / samplesPerSimulationStep));
+                publishFramesIfDue(blockStart + position);
+                samplesUntilNextStep = samplesPerSimulationStep;
+            }
 
-                    // MidiMessage understanding of 'channel' is 1-based, not 0-based
-                    int ch = lastChannelForNote[midiNote] + 1;
+            // The synth renders after all segments are done, so a window that closed part way through the last
+            // segment can still be placed at exactly the right sample
+            coalescer.flush(blockStart + position, emitTrigger);
 
-                    simulationMidiEvents.addEvent(MidiMessage::controllerEvent(ch, 10, static_cast<int>((pan + 1.0f)*64.0f)), i);
-                    simulationMidiEvents.addEvent(MidiMessage::noteOn(ch, midiNote,velocity), i);
-                    simulationMidiEvents.addEvent(MidiMessage::noteOff(ch, midiNote), i + noteLengthSamples);
-                }, simulationTimeScale);
-                sampleStepCounter = 0;
+            int segmentEnd = std::min(numSamples, position + samplesUntilNextStep);
+            if (nextMidiEvent != midiInput.end()) {
+                segmentEnd = std::min(segmentEnd, (*nextMidiEvent).samplePosition);
             }
+            samplesUntilNextStep -= segmentEnd - position;
+            position = segmentEnd;
         }
+        coalescer.flush(blockStart + numSamples - 1, emitTrigger);
+        sampleClock += audio.getNumSamples();
         audio.clear();
 
         MidiBuffer midiEventsForCurrentSampleRange;
-        midiEventsForCurrentSampleRange.addEvents(simulationMidiEvents, 0, audio.getNumSamples(), 0);
+        {
+            TRACE_SCOPE("event conversion");
+            midiEventsForCurrentSampleRange.addEvents(simulationMidiEvents, 0, audio.getNumSamples(), 0);
 
-        // Anything past the current sample range gets put into the overflow buffer for the next cycle
-        overflowBuffer.addEvents(simulationMidiEvents, audio.getNumSamples(), maximumMidiFutureInSamples, -audio.getNumSamples());
+            // Anything past the current sample range gets put into the overflow buffer for the next cycle
+            overflowBuffer.addEvents(simulationMidiEvents, audio.getNumSamples(), maximumMidiFutureInSamples, -audio.getNumSamples());
+        }
 
-        synth.renderNextBlock(audio, midiEventsForCurrentSampleRange, 0,audio.getNumSamples());
+        {
+            TRACE_SCOPE("synth render");
+            synth.render(audio, midiEventsForCurrentSampleRange, 0,audio.getNumSamples());
+        }
 
-        audio.applyGain(pow(10, getParameterValue(Params::MASTER)/10));
+        {
+            TRACE_SCOPE("gain");
+            audio.applyGain(pow(10, getParameterValue(Params::MASTER)/10));
+        }
 
         // If we want to allow midi "sidechain" output (the only way to support plugin midi effects in some hosts) then
         // we need to leave some midi data in the buffer that we were given at the start
@@ -247,9 +773,15 @@ public:
         midiInput.addEvents(midiEventsForCurrentSampleRange, 0, audio.getNumSamples(), 0);
     }
 
-    // TODO derive from attack/decay settings
+    // Number of collision triggers which have been merged into another trigger of the same note
+    uint64 getMergedTriggerCount() const {
+        return coalescer.getMergedTriggerCount();
+    }
+
     double getTailLengthSeconds() const override {
-        return 0.5;
+        // A trigger can sit in the coalescer for a whole window before it even starts sounding
+        auto coalesceWindow = state.getRawParameterValue(Params::COALESCE)->load() * 0.001;
+        return synth.getTailLengthSeconds() + coalesceWindow;
     }
 
     AudioProcessorEditor* createEditor() override;
@@ -260,7 +792,7 @@ AudioProcessor* JUCE_CALLTYPE createPluginFilter()
     return new ParticlesAudioProcessor();
 }
 
-class ParticlesPluginEditor: public AudioProcessorEditor {
+class ParticlesPluginEditor: public AudioProcessorEditor, private Timer {
 private:
     struct ParameterControl {
         Slider slider;
@@ -272,27 +804,54 @@ private:
     ParticleSimulationVisualiser simulationVisualiser;
     std::vector<std::unique_ptr<ParameterControl>> parameterControls;
 
+    // The first controls belong to the simulation section, the rest to the synthesiser section
+    size_t numSimulationControls = 0;
+
+    // Controls are laid out in a grid this many controls wide, and the section headings move to fit them
+    static constexpr int controlColumns = 4;
+    static constexpr int controlWidth = 100, controlHeight = 100, headingHeight = 20;
+    static constexpr int controlPanelWidth = controlColumns * controlWidth;
+    int synthesisHeadingY = 320;
+
     HyperlinkButton vitlingButton;
+
+    // Shows how much work the coalescer is saving, so the window can be tuned by ear and by numbers
+    ParticlesAudioProcessor &particlesProcessor;
+    Label mergedTriggersLabel;
+
+    void timerCallback() override {
+        mergedTriggersLabel.setText("Merged hits: " + String(particlesProcessor.getMergedTriggerCount()), dontSendNotification);
+    }
+
 public:
     explicit ParticlesPluginEditor(ParticlesAudioProcessor &proc):
             AudioProcessorEditor(proc),
-            simulationVisualiser(proc.sim),
-            vitlingButton("Plugin by Vitling", URL("https://www.vitling.xyz")) {
+            simulationVisualiser(proc.sim, proc.visualFrames),
+            vitlingButton("Plugin by Vitling", URL("https://www.vitling.xyz")),
+            particlesProcessor(proc) {
         // Default size on the small side (in case of small screen)
-        setSize(800,600);
+        setSize(1000,600);
 
         // Allow user to resize within sensible limits so that we can still show all controls and a reasonable
         // picture of the simulation
         setResizable(true, true);
-        setResizeLimits(760, 560, 1400, 1200);
+        setResizeLimits(960, 560, 1500, 1200);
 
         // Create default rotary controllers for all parameters exposed in the parameter state
-        createSimpleControls(proc.state, Params::all());
+        createSimpleControls(proc.state, Params::simulation());
+        numSimulationControls = parameterControls.size();
+        createSimpleControls(proc.state, Params::synthesis());
 
         vitlingButton.setColour(HyperlinkButton::ColourIds::textColourId, Colours::white);
 
         addAndMakeVisible(vitlingButton);
 
+        mergedTriggersLabel.setColour(Label::textColourId, Colours::white);
+        mergedTriggersLabel.setJustificationType(Justification::centred);
+        addAndMakeVisible(mergedTriggersLabel);
+        timerCallback();
+        startTimerHz(4);
+
         addAndMakeVisible(simulationVisualiser);
 
         // Don't wait until resize to set the bounds of subcomponents
@@ -320,30 +879,31 @@ public:
         }
     }
 
-    void doLayout() {
-        auto bounds = getLocalBounds();
-
-        // Lay out parameter controls in a grid
-        const auto controlWidth = 100, controlHeight = 100, controlPanelWidth = 200;
-        //auto x = 0, y = 0;
-
+    // Lays out a run of controls in a grid below the given y position, returning the y position after the last row
+    int layoutControls(size_t first, size_t last, int top) {
         auto pNum = 0;
-
-        for (auto &control: parameterControls) {
-
-            // Hack to get sim/sound parameters separated visually
-            if (pNum == 5) pNum++;
-
-            int x = (pNum % 2) * controlWidth;
-            int y = (pNum / 2) * controlHeight + 20 + (pNum >5 ? 20: 0);
+        for (auto i = first; i < last; i++) {
+            auto &control = parameterControls[i];
+            int x = (pNum % controlColumns) * controlWidth;
+            int y = (pNum / controlColumns) * controlHeight + top;
 
             control->slider.setBounds(x,y,controlWidth,controlHeight-20);
             control->label.setBounds(x,y + controlHeight-20,controlWidth,20);
-            
+
             pNum++;
         }
+        int rows = (pNum + controlColumns - 1) / controlColumns;
+        return top + rows * controlHeight;
+    }
+
+    void doLayout() {
+        auto bounds = getLocalBounds();
+
+        synthesisHeadingY = layoutControls(0, numSimulationControls, headingHeight);
+        auto end = layoutControls(numSimulationControls, parameterControls.size(), synthesisHeadingY + headingHeight);
 
-        vitlingButton.setBounds(0,540,200,20);
+        vitlingButton.setBounds(0,end,controlPanelWidth / 2,20);
+        mergedTriggersLabel.setBounds(controlPanelWidth / 2,end,controlPanelWidth / 2,20);
 
         // Use the rest of the available space right of the control panel for the simulation visualiser
         simulationVisualiser.setBounds(controlPanelWidth,0,bounds.getWidth()-controlPanelWidth, bounds.getHeight());
@@ -363,11 +923,11 @@ public:
         g.setGradientFill(colourfulBackground());
         g.fillAll();
         g.setColour(Colours::white);
-        g.drawText("Simulation", 0,0,200,20,Justification::centred, false);
-        g.drawText("Synthesiser", 0,320,200,20,Justification::centred, false);
-        g.drawLine(0,20,200,20);
-        g.drawLine(0,320,200,320);
-        g.drawLine(0,340,200,340);
+        g.drawText("Simulation", 0,0,controlPanelWidth,headingHeight,Justification::centred, false);
+        g.drawText("Synthesiser", 0,synthesisHeadingY,controlPanelWidth,headingHeight,Justification::centred, false);
+        g.drawLine(0,headingHeight,controlPanelWidth,headingHeight);
+        g.drawLine(0,synthesisHeadingY,controlPanelWidth,synthesisHeadingY);
+        g.drawLine(0,synthesisHeadingY + headingHeight,controlPanelWidth,synthesisHeadingY + headingHeight);
     }
 };
 
@@ -0,0 +1,177 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_RESONATORBANK_H
+#define PARTICLES_PLUGIN_RESONATORBANK_H
+
+#include <cmath>
+
+/** Modal synthesis engine with one struck resonator per midi note
+ *  Instead of each collision starting its own voice, a collision injects an impulse into the resonator for its note, so
+ *  the cost depends on how many pitches are ringing rather than how often they are hit. Each resonator is a handful of
+ *  harmonic modes, each of which is a damped complex oscillator (one per stereo side), and the waveform setting morphs
+ *  between a pure sine and the first few partials of a saw.
+ */
+class ResonatorBank {
+private:
+    static constexpr int NUM_NOTES = 128;
+    static constexpr int NUM_HARMONICS = 4;
+    // Every note has NUM_HARMONICS modes for each of the two stereo sides, stored side by side so the inner loop runs
+    // over LANES independent oscillators and can be vectorised
+    static constexpr int LANES = 2 * NUM_HARMONICS;
+    static constexpr float TAU = 6.283185307179586f;
+    static constexpr float OUTPUT_GAIN = 0.2f;
+    static constexpr float SILENCE_THRESHOLD = 1.0e-8f;
+    // A full-scale strike starts at an amplitude of OUTPUT_GAIN, and is treated as finished once its energy drops
+    // below SILENCE_THRESHOLD, which takes this many half-lives
+    static constexpr float HALF_LIVES_TO_SILENCE = 12.0f;
+
+    struct Resonator {
+        float re[LANES] = {};
+        float im[LANES] = {};
+        // Per-sample rotation and decay of each mode, as a complex multiplier
+        float coeffRe[LANES] = {};
+        float coeffIm[LANES] = {};
+        bool active = false;
+    };
+
+    Resonator resonators[NUM_NOTES];
+
+    float sampleRate = 44100.0f;
+    float decayHalfLife = 0.05f;
+    float waveform = 0.0f;
+    bool coefficientsDirty = true;
+
+    static float noteInHertz(int note) {
+        return 440.0f * std::pow(2.0f, float(note - 69) / 12.0f);
+    }
+
+    void updateCoefficients() {
+        float decay = std::pow(0.5f, 1.0f / (sampleRate * decayHalfLife));
+        for (auto note = 0; note < NUM_NOTES; note++) {
+            auto &res = resonators[note];
+            for (auto h = 0; h < NUM_HARMONICS; h++) {
+                float frequency = noteInHertz(note) * float(h + 1);
+                // Anything above nyquist would alias, so those modes are just left silent
+                float omega = frequency < sampleRate / 2 ? TAU * frequency / sampleRate : 0.0f;
+                float magnitude = frequency < sampleRate / 2 ? decay : 0.0f;
+                for (auto side = 0; side < 2; side++) {
+                    res.coeffRe[side * NUM_HARMONICS + h] = magnitude * std::cos(omega);
+                    res.coeffIm[side * NUM_HARMONICS + h] = magnitude * std::sin(omega);
+                }
+            }
+        }
+        coefficientsDirty = false;
+    }
+
+    // Blend of sine and saw partial amplitudes, matching the sin->saw crossfade of the voice engine
+    float harmonicAmplitude(int harmonic) const {
+        const float sawScale = 2.0f / 3.14159265f;
+        float saw = waveform * sawScale / float(harmonic + 1);
+        return harmonic == 0 ? (1.0f - waveform) + saw : saw;
+    }
+
+public:
+    void setSampleRate(float newSampleRate) {
+        sampleRate = newSampleRate;
+        coefficientsDirty = true;
+    }
+
+    void setDecayHalfLife(float halfLife) {
+        decayHalfLife = halfLife;
+        coefficientsDirty = true;
+    }
+
+    void setWaveform(float newWaveform) {
+        waveform = newWaveform;
+    }
+
+    // Inject an impulse into a note's resonator. The gains are the per-side pan amplitudes
+    void strike(int note, float velocity, float leftGain, float rightGain) {
+        if (note < 0 || note >= NUM_NOTES) return;
+        auto &res = resonators[note];
+        for (auto h = 0; h < NUM_HARMONICS; h++) {
+            // Adding to the real part means the imaginary output starts from zero, so there is no click
+            float amplitude = velocity * OUTPUT_GAIN * harmonicAmplitude(h);
+            res.re[h] += leftGain * amplitude;
+            res.re[NUM_HARMONICS + h] += rightGain * amplitude;
+        }
+        res.active = true;
+    }
+
+    bool isSilent() const {
+        for (const auto &res : resonators) {
+            if (res.active) return false;
+        }
+        return true;
+    }
+
+    // How long a full-scale strike keeps ringing
+    float getTailLengthSeconds() const {
+        return HALF_LIVES_TO_SILENCE * decayHalfLife;
+    }
+
+    // Add the output of every ringing resonator to the given stereo buffers
+    void render(float *left, float *right, int numSamples) {
+        if (numSamples <= 0) return;
+        if (coefficientsDirty) updateCoefficients();
+
+        for (auto &res : resonators) {
+            if (!res.active) continue;
+
+            float re[LANES], im[LANES];
+            for (auto lane = 0; lane < LANES; lane++) {
+                re[lane] = res.re[lane];
+                im[lane] = res.im[lane];
+            }
+
+            for (auto i = 0; i < numSamples; i++) {
+                float out[LANES];
+                for (auto lane = 0; lane < LANES; lane++) {
+                    float nextRe = re[lane] * res.coeffRe[lane] - im[lane] * res.coeffIm[lane];
+                    float nextIm = re[lane] * res.coeffIm[lane] + im[lane] * res.coeffRe[lane];
+                    re[lane] = nextRe;
+                    im[lane] = nextIm;
+                    out[lane] = nextIm;
+                }
+                float l = 0.0f, r = 0.0f;
+                for (auto h = 0; h < NUM_HARMONICS; h++) {
+                    l += out[h];
+                    r += out[NUM_HARMONICS + h];
+                }
+                left[i] += l;
+                right[i] += r;
+            }
+
+            float energy = 0.0f;
+            for (auto lane = 0; lane < LANES; lane++) {
+                res.re[lane] = re[lane];
+                res.im[lane] = im[lane];
+                energy += re[lane] * re[lane] + im[lane] * im[lane];
+            }
+            if (energy < SILENCE_THRESHOLD) {
+                for (auto lane = 0; lane < LANES; lane++) {
+                    res.re[lane] = 0.0f;
+                    res.im[lane] = 0.0f;
+                }
+                res.active = false;
+            }
+        }
+    }
+};
+
+#endif //PARTICLES_PLUGIN_RESONATORBANK_H
@@ -0,0 +1,191 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_SHAREDSTATE_H
+#define PARTICLES_PLUGIN_SHAREDSTATE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** Layout of the shared memory region that the plugin can publish simulation state into, for rendering the particles
+ *  in a separate process (see SharedStatePublisher), and a reader for it. This header has no dependencies beyond POSIX,
+ *  so an external renderer can just copy it.
+ *
+ *  The region is a Header followed by a ring of NUM_FRAMES frames, each a FrameHeader followed by room for maxParticles
+ *  ParticleRecords. Each frame has its own sequence number, which is odd while the frame is being written (a seqlock),
+ *  so a reader can copy a frame without ever making the writer wait, and check afterwards whether it got a clean copy.
+ *  Shared memory isn't available on Windows, where opening always fails.
+ */
+namespace SharedState {
+    constexpr char MAGIC[4] = {'P', 'S', 'H', 'M'};
+    constexpr uint32_t VERSION = 1;
+
+    struct ParticleRecord {
+        // Position and radius in chamber units (see FrameHeader for the chamber size)
+        float x;
+        float y;
+        float radius;
+        // Degrees, as used by the plugin's own view
+        float hue;
+        // 1 at the moment of a collision, fading to 0 over the following steps
+        float flash;
+        uint32_t note;
+    };
+    static_assert(sizeof(ParticleRecord) == 24, "Particle records are shared with other processes, so their layout must not change");
+
+    struct alignas(64) FrameHeader {
+        std::atomic<uint32_t> sequence;
+        uint32_t numParticles;
+        uint64_t frameNumber;
+        // Time of the simulation step that produced this frame, on the plugin's audio clock
+        int64_t sampleTime;
+        double sampleRate;
+        float width;
+        float height;
+    };
+
+    struct alignas(64) Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t numFrames;
+        uint32_t maxParticles;
+        // One more than the number of the newest complete frame, or 0 before anything has been published
+        std::atomic<uint64_t> framesPublished;
+        // Process id of the publisher, so that a region left behind by a crash can be told apart from one in use
+        uint32_t publisherProcess;
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+                  "Atomics shared between processes must be lock free");
+
+    inline size_t frameSize(uint32_t maxParticles) {
+        const size_t size = sizeof(FrameHeader) + size_t(maxParticles) * sizeof(ParticleRecord);
+        return (size + 63) / 64 * 64;
+    }
+
+    inline size_t regionSize(uint32_t numFrames, uint32_t maxParticles) {
+        return sizeof(Header) + size_t(numFrames) * frameSize(maxParticles);
+    }
+
+    struct FrameInfo {
+        uint64_t frameNumber;
+        int64_t sampleTime;
+        double sampleRate;
+        float width;
+        float height;
+    };
+
+    /** Maps a published region read-only and copies frames out of it */
+    class Reader {
+    private:
+        const char *base = nullptr;
+        size_t size = 0;
+
+        const Header &header() const {
+            return *reinterpret_cast<const Header*>(base);
+        }
+
+        const FrameHeader &frame(uint64_t frameNumber) const {
+            const auto index = frameNumber % header().numFrames;
+            return *reinterpret_cast<const FrameHeader*>(base + sizeof(Header) + index * frameSize(header().maxParticles));
+        }
+
+    public:
+        Reader() = default;
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        ~Reader() {
+            close();
+        }
+
+        bool open(const char *name) {
+            close();
+#if defined(_WIN32)
+            (void) name;
+            return false;
+#else
+            const int fd = shm_open(name, O_RDONLY, 0);
+            if (fd < 0) return false;
+            struct stat info {};
+            if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(Header)) {
+                ::close(fd);
+                return false;
+            }
+            auto mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            // The mapping stays valid after the descriptor is closed
+            ::close(fd);
+            if (mapping == MAP_FAILED) return false;
+            base = static_cast<const char*>(mapping);
+            size = size_t(info.st_size);
+
+            const auto &h = header();
+            bool valid = h.version == VERSION && h.numFrames > 0 && size >= regionSize(h.numFrames, h.maxParticles);
+            for (auto i = 0; i < 4; i++) valid = valid && h.magic[i] == MAGIC[i];
+            if (!valid) close();
+            return valid;
+#endif
+        }
+
+        void close() {
+#if !defined(_WIN32)
+            if (base != nullptr) munmap(const_cast<char*>(base), size);
+#endif
+            base = nullptr;
+            size = 0;
+        }
+
+        bool isOpen() const {
+            return base != nullptr;
+        }
+
+        uint64_t getFramesPublished() const {
+            return isOpen() ? header().framesPublished.load(std::memory_order_acquire) : 0;
+        }
+
+        /** Copy the newest complete frame. Returns false if nothing has been published yet, or if the writer kept
+         *  overwriting the frame while we were copying it (which means we're reading much slower than it's writing) */
+        bool readLatest(std::vector<ParticleRecord> &particles, FrameInfo &info) const {
+            for (auto attempt = 0; attempt < 4; attempt++) {
+                const auto published = getFramesPublished();
+                if (published == 0) return false;
+                const auto &f = frame(published - 1);
+
+                const auto before = f.sequence.load(std::memory_order_acquire);
+                if (before % 2 != 0) continue;
+                const auto count = f.numParticles < header().maxParticles ? f.numParticles : header().maxParticles;
+                info = {f.frameNumber, f.sampleTime, f.sampleRate, f.width, f.height};
+                auto records = reinterpret_cast<const ParticleRecord*>(&f + 1);
+                particles.assign(records, records + count);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (f.sequence.load(std::memory_order_relaxed) == before && info.frameNumber == published - 1) return true;
+            }
+            return false;
+        }
+    };
+}
+
+#endif //PARTICLES_PLUGIN_SHAREDSTATE_H
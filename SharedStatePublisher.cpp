@@ -0,0 +1,160 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "SharedStatePublisher.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#if !defined(_WIN32)
+#include <signal.h>
+#endif
+#include "ParticleSimulation.h"
+#include "TimelineTrace.h"
+
+#if !defined(_WIN32)
+namespace {
+    // Whether the named region was set up by a publisher whose process has since gone away. Anything we can't be sure
+    // about (a region still being set up, one from an older plugin, one that isn't ours at all) counts as in use
+    bool isAbandoned(const char *regionName) {
+        const int fd = shm_open(regionName, O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat info {};
+        void *mapping = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(SharedState::Header)) {
+            mapping = mmap(nullptr, sizeof(SharedState::Header), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) return false;
+
+        const auto &header = *static_cast<const SharedState::Header*>(mapping);
+        const bool ready = std::memcmp(header.magic, SharedState::MAGIC, sizeof(SharedState::MAGIC)) == 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const auto publisher = pid_t(header.publisherProcess);
+        munmap(mapping, sizeof(SharedState::Header));
+        return ready && publisher > 0 && kill(publisher, 0) != 0 && errno == ESRCH;
+    }
+}
+#endif
+
+bool SharedStatePublisher::open(const char *regionName, int particles) {
+    close();
+#if defined(_WIN32)
+    (void) regionName;
+    (void) particles;
+    return false;
+#else
+    if (particles < 1) particles = 1;
+    const auto regionSize = SharedState::regionSize(NUM_FRAMES, uint32_t(particles));
+
+    int fd = shm_open(regionName, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST && isAbandoned(regionName)) {
+        shm_unlink(regionName);
+        fd = shm_open(regionName, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0) return false;
+    struct stat info {};
+    if (fstat(fd, &info) != 0 || ftruncate(fd, off_t(regionSize)) != 0) {
+        ::close(fd);
+        shm_unlink(regionName);
+        return false;
+    }
+    auto mapping = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(regionName);
+        return false;
+    }
+
+    base = static_cast<char*>(mapping);
+    size = regionSize;
+    name = regionName;
+    device = uint64_t(info.st_dev);
+    inode = uint64_t(info.st_ino);
+    maxParticles = uint32_t(particles);
+    framesPublished = 0;
+
+    // Writing the whole region now means the audio thread never takes a page fault on first touching a page
+    std::memset(base, 0, size);
+    auto header = new (base) SharedState::Header {};
+    header->version = SharedState::VERSION;
+    header->numFrames = NUM_FRAMES;
+    header->maxParticles = maxParticles;
+    header->publisherProcess = uint32_t(getpid());
+    for (uint32_t i = 0; i < NUM_FRAMES; i++) {
+        new (base + sizeof(SharedState::Header) + i * SharedState::frameSize(maxParticles)) SharedState::FrameHeader {};
+    }
+    // The magic goes in last, so a reader never accepts a half set up region
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, SharedState::MAGIC, sizeof(SharedState::MAGIC));
+    return true;
+#endif
+}
+
+void SharedStatePublisher::close() {
+#if !defined(_WIN32)
+    if (base != nullptr) {
+        munmap(base, size);
+        // Readers which already have it mapped can carry on reading the last frames. If something else has since
+        // taken over the name, the name is theirs now and is left alone
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd >= 0) {
+            struct stat info {};
+            const bool ours = fstat(fd, &info) == 0 && uint64_t(info.st_dev) == device && uint64_t(info.st_ino) == inode;
+            ::close(fd);
+            if (ours) shm_unlink(name.c_str());
+        }
+    }
+#endif
+    base = nullptr;
+    size = 0;
+}
+
+void SharedStatePublisher::publish(const ParticleSimulation &sim, int64_t sampleTime, double sampleRate) {
+    if (base == nullptr) return;
+    TRACE_SCOPE("shared state");
+
+    auto header = reinterpret_cast<SharedState::Header*>(base);
+    const auto frameOffset = sizeof(SharedState::Header) + (framesPublished % NUM_FRAMES) * SharedState::frameSize(maxParticles);
+    auto frame = reinterpret_cast<SharedState::FrameHeader*>(base + frameOffset);
+    auto records = reinterpret_cast<SharedState::ParticleRecord*>(frame + 1);
+
+    // Odd while writing, so readers know to discard anything they copy in the meantime
+    const auto sequence = frame->sequence.load(std::memory_order_relaxed);
+    frame->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const auto &store = *sim.arena.load();
+    const int slots = store.slotsInUse;
+    uint32_t count = 0;
+    for (auto i = 0; i < slots && count < maxParticles; i++) {
+        const auto &particle = store.particles[i];
+        if (!particle.enabled) continue;
+        // Same fade as the plugin's own view
+        const float flash = particle.lastCollided < 20.0f ? (20.0f - particle.lastCollided) / 20.0f : 0.0f;
+        records[count++] = {float(particle.pos.x), float(particle.pos.y), float(particle.radius), float(particle.hue),
+                            flash, uint32_t(particle.note)};
+    }
+    frame->numParticles = count;
+    frame->frameNumber = framesPublished;
+    frame->sampleTime = sampleTime;
+    frame->sampleRate = sampleRate;
+    frame->width = sim.w;
+    frame->height = sim.h;
+
+    frame->sequence.store(sequence + 2, std::memory_order_release);
+    header->framesPublished.store(++framesPublished, std::memory_order_release);
+}
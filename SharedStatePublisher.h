@@ -0,0 +1,72 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_SHAREDSTATEPUBLISHER_H
+#define PARTICLES_PLUGIN_SHAREDSTATEPUBLISHER_H
+
+#include <cstdint>
+#include <string>
+#include "SharedState.h"
+
+class ParticleSimulation;
+
+/** Writes simulation snapshots into a named shared memory region (see SharedState.h for the layout), so that the
+ *  particles can be drawn by another process without going anywhere near the audio thread.
+ *  open and close create and remove the region, so they belong on the message thread. publish only copies into memory
+ *  that was mapped and touched by open, so it can be called from the audio thread.
+ */
+class SharedStatePublisher {
+private:
+    char *base = nullptr;
+    size_t size = 0;
+    std::string name;
+    // Identity of the region we created, so that close only removes the name if it still refers to our region
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint32_t maxParticles = 0;
+    uint64_t framesPublished = 0;
+
+public:
+    static constexpr uint32_t NUM_FRAMES = 4;
+
+    SharedStatePublisher() = default;
+    SharedStatePublisher(const SharedStatePublisher&) = delete;
+    SharedStatePublisher& operator=(const SharedStatePublisher&) = delete;
+
+    ~SharedStatePublisher() {
+        close();
+    }
+
+    /** Create the region, with room for frames of up to maxParticles. Fails if the name is already in use, unless the
+     *  region using it was left behind by a process that no longer exists, in which case it is replaced. Always fails
+     *  on Windows */
+    bool open(const char *regionName, int maxParticles);
+    void close();
+
+    bool isOpen() const {
+        return base != nullptr;
+    }
+
+    const std::string &getName() const {
+        return name;
+    }
+
+    // Copy the current state of the simulation into the next frame. Particles beyond maxParticles are left out
+    void publish(const ParticleSimulation &sim, int64_t sampleTime, double sampleRate);
+};
+
+#endif //PARTICLES_PLUGIN_SHAREDSTATEPUBLISHER_H
@@ -0,0 +1,107 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_SIMULATIONCHECKPOINTS_H
+#define PARTICLES_PLUGIN_SIMULATIONCHECKPOINTS_H
+
+#include <cstdint>
+#include <vector>
+#include "ParticleSimulation.h"
+
+/** A bounded set of simulation checkpoints, each labelled with the position it was taken at
+ *  Positions are counted from wherever the caller likes; the plugin uses samples on the host timeline, so that going
+ *  back to a point in the song can put the chamber back how it was when the song last played through there. When full,
+ *  the checkpoint which was saved or restored longest ago is the one that gets reused, so one that keeps being returned
+ *  to (like the start of a loop) stays put. Everything is allocated up front by the constructor.
+ */
+class SimulationCheckpoints {
+private:
+    struct Entry {
+        int64_t position = -1;
+        // When this entry was last saved or restored, in operations, so the least recently used can be found
+        uint64_t usedAt = 0;
+        ParticleSimulation::Checkpoint checkpoint;
+    };
+
+    std::vector<Entry> entries;
+    const int particleCapacity;
+    uint64_t useCount = 0;
+
+    // Index of the latest entry at or before 'position', but no more than 'maxDistance' before it, or -1
+    int findEntry(int64_t position, int64_t maxDistance) const {
+        int best = -1;
+        for (auto i = 0; i < int(entries.size()); i++) {
+            const auto &entry = entries[size_t(i)];
+            if (entry.position < 0 || entry.position > position || position - entry.position > maxDistance) continue;
+            if (best < 0 || entry.position > entries[size_t(best)].position) best = i;
+        }
+        return best;
+    }
+
+public:
+    SimulationCheckpoints(int numCheckpoints, int particleCapacity): particleCapacity(particleCapacity) {
+        entries.reserve(size_t(numCheckpoints));
+        for (auto i = 0; i < numCheckpoints; i++) {
+            entries.push_back({-1, 0, ParticleSimulation::Checkpoint(particleCapacity)});
+        }
+    }
+
+    int getParticleCapacity() const {
+        return particleCapacity;
+    }
+
+    void clear() {
+        for (auto &entry : entries) {
+            entry.position = -1;
+        }
+    }
+
+    // Save the simulation at the given position, replacing whatever was saved for that position before
+    bool save(int64_t position, const ParticleSimulation &sim) {
+        Entry *target = nullptr;
+        for (auto &entry : entries) {
+            if (entry.position == position) {
+                target = &entry;
+                break;
+            }
+            if (target == nullptr || entry.usedAt < target->usedAt) target = &entry;
+        }
+        if (target == nullptr || !sim.saveCheckpoint(target->checkpoint)) return false;
+        target->position = position;
+        target->usedAt = ++useCount;
+        return true;
+    }
+
+    // The position restoreNearest() would restore, or -1 if there's nothing suitable
+    int64_t findNearest(int64_t position, int64_t maxDistance) const {
+        const auto best = findEntry(position, maxDistance);
+        return best < 0 ? -1 : entries[size_t(best)].position;
+    }
+
+    /** Restore the latest checkpoint at or before 'position', but no more than 'maxDistance' before it. Returns the
+     *  position that was restored, or -1 if there was nothing suitable, in which case the simulation is left as it was */
+    int64_t restoreNearest(int64_t position, int64_t maxDistance, ParticleSimulation &sim) {
+        const auto index = findEntry(position, maxDistance);
+        if (index < 0) return -1;
+        auto &best = entries[size_t(index)];
+        if (!sim.restoreCheckpoint(best.checkpoint)) return -1;
+        best.usedAt = ++useCount;
+        return best.position;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_SIMULATIONCHECKPOINTS_H
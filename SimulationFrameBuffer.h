@@ -0,0 +1,167 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_SIMULATIONFRAMEBUFFER_H
+#define PARTICLES_PLUGIN_SIMULATIONFRAMEBUFFER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "ParticleSimulation.h"
+
+/** Hands copies of the simulation state from the audio thread to the UI, so that drawing never reads particles while
+ *  they're being stepped, and so the UI has two timestamped states to interpolate between.
+ *  This is a triple buffer: the audio thread fills one frame while the UI reads another, and the third is passed between
+ *  them with a single atomic exchange, so neither side ever waits for the other. The frames have room for as many
+ *  particles as the simulation can hold; when that changes, the new space is allocated first and swapped in afterwards.
+ */
+class SimulationFrameBuffer {
+public:
+    struct Particle {
+        float x;
+        float y;
+        float radius;
+        float hue;
+        float lastCollided;
+        int note;
+        // Index of the particle in the simulation, which stays the same for as long as the particle exists
+        int slot;
+        // Identifies the particle itself, as a slot can be reused as soon as its particle is gone
+        uint32_t id;
+    };
+
+    struct Frame {
+        std::vector<Particle> particles;
+        int numParticles = 0;
+        // Audio clock time of the state, and wall clock time (see now()) of when it was published
+        int64_t sampleTime = 0;
+        double sampleRate = 44100.0;
+        double publishedAt = 0.0;
+        float width = 1000.0f;
+        float height = 1000.0f;
+    };
+
+    // Particle space for all the frames, allocated ahead of being swapped in with swapStorage()
+    struct Storage {
+        std::vector<Particle> particles[3];
+        int maxParticles;
+
+        explicit Storage(int maxParticles): maxParticles(maxParticles) {
+            for (auto &frame : particles) {
+                frame.resize(size_t(maxParticles));
+            }
+        }
+    };
+
+private:
+    static constexpr int INDEX_MASK = 3;
+    static constexpr int NEW_FRAME = 4;
+
+    Frame frames[3];
+    // The frame in the middle, plus NEW_FRAME if the audio thread has put one there that the UI hasn't taken yet
+    std::atomic<int> middle {1};
+    int back = 0;
+    int front = 2;
+    int maxParticles;
+    bool lastPublishedEmpty = false;
+    // There's no point copying frames out when nothing is going to look at them
+    std::atomic<bool> hasReader {false};
+
+public:
+    explicit SimulationFrameBuffer(int maxParticles): maxParticles(maxParticles) {
+        for (auto &frame : frames) {
+            frame.particles.resize(size_t(maxParticles));
+        }
+    }
+
+    int getMaxParticles() const {
+        return maxParticles;
+    }
+
+    /** Swap the frames' particle space for 'storage', leaving the old space in 'storage' to be freed by the caller.
+     *  This must be called on the UI thread, while the audio thread can't be publishing (i.e. holding the callback lock).
+     *  A frame waiting for the UI is dropped, as its particles don't come across; the next publish replaces it */
+    void swapStorage(Storage &storage) {
+        for (auto i = 0; i < 3; i++) {
+            frames[i].particles.swap(storage.particles[i]);
+            frames[i].numParticles = 0;
+        }
+        std::swap(maxParticles, storage.maxParticles);
+        middle = middle.load() & INDEX_MASK;
+        lastPublishedEmpty = false;
+    }
+
+    // Milliseconds on a steady clock, which the audio and UI threads share
+    static double now() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Set while something (i.e. an open editor) is fetching frames
+    void setHasReader(bool reading) {
+        hasReader = reading;
+    }
+
+    // Copy the current state in and pass it over to the UI. Audio thread only
+    void publish(const ParticleSimulation &sim, int64_t sampleTime, double sampleRate) {
+        if (!hasReader.load(std::memory_order_relaxed)) {
+            // Make sure whoever reads next gets at least one frame, even of an empty chamber
+            lastPublishedEmpty = false;
+            return;
+        }
+        const auto &store = *sim.arena.load();
+        const int slots = store.slotsInUse;
+        // Once the UI has been told the chamber is empty there's no need to keep telling it
+        if (slots == 0 && lastPublishedEmpty) return;
+
+        auto &frame = frames[back];
+        int count = 0;
+        for (auto i = 0; i < slots && count < maxParticles; i++) {
+            const auto &p = store.particles[i];
+            if (!p.enabled) continue;
+            frame.particles[size_t(count++)] = {float(p.pos.x), float(p.pos.y), float(p.radius), float(p.hue),
+                                                p.lastCollided, p.note, i, p.id};
+        }
+        frame.numParticles = count;
+        frame.sampleTime = sampleTime;
+        frame.sampleRate = sampleRate;
+        frame.publishedAt = now();
+        frame.width = sim.w;
+        frame.height = sim.h;
+        lastPublishedEmpty = count == 0;
+
+        back = middle.exchange(back | NEW_FRAME) & INDEX_MASK;
+    }
+
+    // If there's been a new frame since last time, copy it into 'into' and return true. UI thread only
+    bool fetch(Frame &into) {
+        if ((middle.load() & NEW_FRAME) == 0) return false;
+        front = middle.exchange(front) & INDEX_MASK;
+        const auto &frame = frames[front];
+        into.particles.assign(frame.particles.begin(), frame.particles.begin() + frame.numParticles);
+        into.numParticles = frame.numParticles;
+        into.sampleTime = frame.sampleTime;
+        into.sampleRate = frame.sampleRate;
+        into.publishedAt = frame.publishedAt;
+        into.width = frame.width;
+        into.height = frame.height;
+        return true;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_SIMULATIONFRAMEBUFFER_H
@@ -0,0 +1,72 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_SIMULATIONRANDOM_H
+#define PARTICLES_PLUGIN_SIMULATIONRANDOM_H
+
+#include <cstdint>
+#include <random>
+
+/** Small, fast random number generator (xorshift128+) with the parts of juce::Random's interface that we use
+ *  This keeps the simulation free of any JUCE dependency, and its whole state is two integers, so it can be copied
+ *  around with the rest of the simulation state.
+ */
+class SimulationRandom {
+private:
+    uint64_t s0 = 0;
+    uint64_t s1 = 0;
+
+    static uint64_t splitMix(uint64_t &x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+public:
+    // Like juce::Random, an unseeded generator gives a different sequence every time
+    SimulationRandom(): SimulationRandom((uint64_t(std::random_device{}()) << 32) ^ std::random_device{}()) {}
+
+    explicit SimulationRandom(uint64_t seed) {
+        setSeed(seed);
+    }
+
+    void setSeed(uint64_t seed) {
+        s0 = splitMix(seed);
+        s1 = splitMix(seed);
+    }
+
+    uint64_t next() {
+        uint64_t x = s0;
+        const uint64_t y = s1;
+        s0 = y;
+        x ^= x << 23;
+        s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+        return s1 + y;
+    }
+
+    // Uniform in [0, 1)
+    float nextFloat() {
+        return float(next() >> 40) * (1.0f / 16777216.0f);
+    }
+
+    bool nextBool() {
+        return (next() >> 63) != 0;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_SIMULATIONRANDOM_H
@@ -0,0 +1,246 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_STATICGEOMETRY_H
+#define PARTICLES_PLUGIN_STATICGEOMETRY_H
+
+#include <algorithm>
+#include <vector>
+#include "Vec.h"
+
+/** Static obstacles placed inside the simulation chamber (circles, line segments and polygons)
+ *  Everything is broken down into circle and segment primitives, which are stored in a bounding volume hierarchy so
+ *  that a particle only has to be tested against the handful of primitives near it. The hierarchy is rebuilt whenever
+ *  the geometry changes, which is expected to happen rarely and never from inside a simulation step.
+ */
+class StaticGeometry {
+public:
+    enum class PrimitiveType {
+        CIRCLE,
+        SEGMENT
+    };
+
+    struct Primitive {
+        PrimitiveType type;
+        // Centre of a circle, or the start of a segment
+        Vec a;
+        // End of a segment (unused for circles)
+        Vec b;
+        double radius;
+        // Polygons produce several primitives, so this identifies the obstacle each one came from
+        int obstacle;
+    };
+
+    struct Contact {
+        // Unit vector pointing from the obstacle surface towards the particle
+        Vec normal;
+        double depth;
+        int obstacle;
+    };
+
+private:
+    struct Bounds {
+        double minX, minY, maxX, maxY;
+
+        bool overlaps(const Bounds &other) const {
+            return minX <= other.maxX && maxX >= other.minX && minY <= other.maxY && maxY >= other.minY;
+        }
+
+        void include(const Bounds &other) {
+            minX = std::min(minX, other.minX);
+            minY = std::min(minY, other.minY);
+            maxX = std::max(maxX, other.maxX);
+            maxY = std::max(maxY, other.maxY);
+        }
+    };
+
+    // Nodes are stored depth-first, so the left child of an internal node is always the next node in the array and
+    // only the right child needs an index. Leaves reference a contiguous range of the primitive array.
+    struct Node {
+        Bounds bounds;
+        int right = -1;
+        int first = 0;
+        int count = 0;
+    };
+
+    static constexpr int MAX_PRIMITIVES_PER_LEAF = 2;
+    static constexpr int MAX_TREE_DEPTH = 64;
+
+    std::vector<Primitive> primitives;
+    std::vector<Node> nodes;
+    int numObstacles = 0;
+
+    static Bounds boundsOf(const Primitive &p) {
+        if (p.type == PrimitiveType::CIRCLE) {
+            return {p.a.x - p.radius, p.a.y - p.radius, p.a.x + p.radius, p.a.y + p.radius};
+        }
+        return {std::min(p.a.x, p.b.x), std::min(p.a.y, p.b.y), std::max(p.a.x, p.b.x), std::max(p.a.y, p.b.y)};
+    }
+
+    static Vec centreOf(const Primitive &p) {
+        return p.type == PrimitiveType::CIRCLE ? p.a : 0.5 * (p.a + p.b);
+    }
+
+    int buildNode(int first, int count, int depth) {
+        int index = int(nodes.size());
+        nodes.push_back({});
+
+        Bounds bounds = boundsOf(primitives[first]);
+        Bounds centres = {centreOf(primitives[first]).x, centreOf(primitives[first]).y,
+                          centreOf(primitives[first]).x, centreOf(primitives[first]).y};
+        for (auto i = first + 1; i < first + count; i++) {
+            bounds.include(boundsOf(primitives[i]));
+            auto c = centreOf(primitives[i]);
+            centres.include({c.x, c.y, c.x, c.y});
+        }
+        nodes[index].bounds = bounds;
+
+        if (count <= MAX_PRIMITIVES_PER_LEAF || depth >= MAX_TREE_DEPTH) {
+            nodes[index].first = first;
+            nodes[index].count = count;
+            return index;
+        }
+
+        // Median split along the longest axis of the primitive centres
+        bool splitX = (centres.maxX - centres.minX) >= (centres.maxY - centres.minY);
+        int half = count / 2;
+        std::nth_element(primitives.begin() + first, primitives.begin() + first + half, primitives.begin() + first + count,
+                         [splitX](const Primitive &p, const Primitive &q) {
+                             return splitX ? centreOf(p).x < centreOf(q).x : centreOf(p).y < centreOf(q).y;
+                         });
+
+        buildNode(first, half, depth + 1);
+        int right = buildNode(first + half, count - half, depth + 1);
+        nodes[index].right = right;
+        return index;
+    }
+
+    void rebuild() {
+        nodes.clear();
+        if (!primitives.empty()) {
+            nodes.reserve(2 * primitives.size());
+            buildNode(0, int(primitives.size()), 0);
+        }
+    }
+
+    static bool contactWith(const Primitive &p, const Vec &pos, double radius, Contact &contact) {
+        Vec closest = p.a;
+        double reach = radius;
+        if (p.type == PrimitiveType::CIRCLE) {
+            reach += p.radius;
+        } else {
+            Vec segment = p.b - p.a;
+            double lengthSquared = segment % segment;
+            double t = lengthSquared == 0.0 ? 0.0 : ((pos - p.a) % segment) / lengthSquared;
+            t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+            closest = p.a + t * segment;
+        }
+
+        Vec offset = pos - closest;
+        double distance = length(offset);
+        if (distance >= reach) return false;
+
+        if (distance > 0.0) {
+            contact.normal = (1.0 / distance) * offset;
+        } else if (p.type == PrimitiveType::SEGMENT) {
+            // Dead centre on the line, so pick one of its perpendiculars
+            auto along = normalise(p.b - p.a);
+            contact.normal = {-along.y, along.x};
+        } else {
+            contact.normal = {0.0, -1.0};
+        }
+        contact.depth = reach - distance;
+        contact.obstacle = p.obstacle;
+        return true;
+    }
+
+public:
+    void addCircle(Vec centre, double radius) {
+        primitives.push_back({PrimitiveType::CIRCLE, centre, centre, radius, numObstacles++});
+        rebuild();
+    }
+
+    void addSegment(Vec start, Vec end) {
+        primitives.push_back({PrimitiveType::SEGMENT, start, end, 0.0, numObstacles++});
+        rebuild();
+    }
+
+    // A closed polygon is stored as its edges, so particles bounce off the outline from either side
+    void addPolygon(const std::vector<Vec> &points) {
+        if (points.size() < 2) return;
+        int obstacle = numObstacles++;
+        for (size_t i = 0; i < points.size(); i++) {
+            primitives.push_back({PrimitiveType::SEGMENT, points[i], points[(i + 1) % points.size()], 0.0, obstacle});
+        }
+        rebuild();
+    }
+
+    void clear() {
+        primitives.clear();
+        nodes.clear();
+        numObstacles = 0;
+    }
+
+    bool isEmpty() const {
+        return primitives.empty();
+    }
+
+    int getNumObstacles() const {
+        return numObstacles;
+    }
+
+    const std::vector<Primitive> &getPrimitives() const {
+        return primitives;
+    }
+
+    // Find the deepest contact between a circle and any obstacle, returning false if it touches nothing.
+    // This only walks the branches of the hierarchy whose bounds overlap the circle, so it is logarithmic in the
+    // number of primitives for any sensibly spread out layout
+    bool findContact(const Vec &pos, double radius, Contact &deepest) const {
+        if (nodes.empty()) return false;
+
+        const Bounds query = {pos.x - radius, pos.y - radius, pos.x + radius, pos.y + radius};
+        bool found = false;
+        deepest.depth = 0.0;
+
+        int stack[MAX_TREE_DEPTH + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const Node &node = nodes[stack[--stackSize]];
+            if (!node.bounds.overlaps(query)) continue;
+
+            if (node.right == -1) {
+                for (auto i = node.first; i < node.first + node.count; i++) {
+                    Contact contact{};
+                    if (contactWith(primitives[i], pos, radius, contact) && contact.depth > deepest.depth) {
+                        deepest = contact;
+                        found = true;
+                    }
+                }
+            } else {
+                int left = int(&node - nodes.data()) + 1;
+                stack[stackSize++] = node.right;
+                stack[stackSize++] = left;
+            }
+        }
+        return found;
+    }
+};
+
+#endif //PARTICLES_PLUGIN_STATICGEOMETRY_H
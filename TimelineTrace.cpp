@@ -0,0 +1,160 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "TimelineTrace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace TimelineTrace {
+    namespace {
+        struct Event {
+            const char *name;
+            int64_t start;
+            int64_t end;
+        };
+
+        /** Single producer (the thread that claimed it), single consumer (the flusher) ring of events. Only the producer
+         *  moves 'head' and only the consumer moves 'tail' */
+        struct Ring {
+            static constexpr size_t SIZE = 1 << 15;
+            Event events[SIZE];
+            std::atomic<size_t> head {0};
+            std::atomic<size_t> tail {0};
+            std::atomic<uint64_t> dropped {0};
+        };
+
+        // Threads claim a ring the first time they record anything, and keep it for good. The rings live for the whole
+        // program, so a thread that is part way through recording when a trace stops or starts is harmless. Being
+        // zero-initialised statics, they don't take up any memory until a trace actually writes to them
+        constexpr int MAX_THREADS = 8;
+        Ring rings[MAX_THREADS];
+        std::atomic<int> claimedRings {0};
+        std::atomic<uint64_t> unclaimedDrops {0};
+
+        // Everything below belongs to whoever holds controlMutex, i.e. start and stop, which any number of plugin
+        // instances may call at once from whichever threads their hosts prepare them on
+        std::mutex controlMutex;
+        std::thread flusher;
+        std::mutex flusherMutex;
+        std::condition_variable flusherWake;
+        bool flusherShouldExit = false;
+        std::FILE *file = nullptr;
+        int64_t epoch = 0;
+        bool firstEvent = true;
+
+        void drain(Ring &ring, int threadId) {
+            const auto head = ring.head.load(std::memory_order_acquire);
+            auto tail = ring.tail.load(std::memory_order_relaxed);
+            for (; tail != head; tail++) {
+                const auto &event = ring.events[tail % Ring::SIZE];
+                // Chrome trace times are in microseconds; fractions keep the nanosecond resolution
+                std::fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                             firstEvent ? "" : ",", event.name, threadId,
+                             double(event.start - epoch) / 1000.0, double(event.end - event.start) / 1000.0);
+                firstEvent = false;
+            }
+            ring.tail.store(tail, std::memory_order_release);
+        }
+
+        void drainAll() {
+            const int claimed = std::min(claimedRings.load(), MAX_THREADS);
+            for (auto i = 0; i < claimed; i++) {
+                drain(rings[i], i + 1);
+            }
+        }
+
+        void runFlusher() {
+            std::unique_lock<std::mutex> lock(flusherMutex);
+            while (!flusherShouldExit) {
+                flusherWake.wait_for(lock, std::chrono::milliseconds(50));
+                drainAll();
+            }
+        }
+    }
+
+    namespace detail {
+        std::atomic<bool> enabled {false};
+
+        void record(const char *name, int64_t start, int64_t end) {
+            thread_local Ring *ring = nullptr;
+            if (ring == nullptr) {
+                const int index = claimedRings.fetch_add(1);
+                if (index >= MAX_THREADS) {
+                    unclaimedDrops.fetch_add(1, std::memory_order_relaxed);
+                    claimedRings.fetch_sub(1);
+                    return;
+                }
+                ring = &rings[index];
+            }
+            const auto head = ring->head.load(std::memory_order_relaxed);
+            if (head - ring->tail.load(std::memory_order_acquire) >= Ring::SIZE) {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            ring->events[head % Ring::SIZE] = {name, start, end};
+            ring->head.store(head + 1, std::memory_order_release);
+        }
+    }
+
+    bool start(const char *path) {
+        const std::lock_guard<std::mutex> control(controlMutex);
+        if (file != nullptr) return false;
+        file = std::fopen(path, "w");
+        if (file == nullptr) return false;
+
+        // Skip anything left over from an earlier trace
+        for (auto i = 0; i < MAX_THREADS; i++) {
+            rings[i].tail.store(rings[i].head.load(std::memory_order_acquire), std::memory_order_release);
+        }
+
+        std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+        firstEvent = true;
+        epoch = detail::now();
+        flusherShouldExit = false;
+        flusher = std::thread(runFlusher);
+        detail::enabled.store(true);
+        return true;
+    }
+
+    void stop() {
+        const std::lock_guard<std::mutex> control(controlMutex);
+        if (file == nullptr) return;
+        detail::enabled.store(false);
+        {
+            const std::lock_guard<std::mutex> lock(flusherMutex);
+            flusherShouldExit = true;
+        }
+        flusherWake.notify_one();
+        flusher.join();
+        drainAll();
+        std::fputs("\n]}\n", file);
+        std::fclose(file);
+        file = nullptr;
+    }
+
+    uint64_t getDroppedEventCount() {
+        uint64_t total = unclaimedDrops.load(std::memory_order_relaxed);
+        const int claimed = std::min(claimedRings.load(), MAX_THREADS);
+        for (auto i = 0; i < claimed; i++) {
+            total += rings[i].dropped.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+}
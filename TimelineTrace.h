@@ -0,0 +1,86 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_TIMELINETRACE_H
+#define PARTICLES_PLUGIN_TIMELINETRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/** Opt-in timeline tracing, for finding out where a particular slow block spent its time
+ *  Code is marked up with TRACE_SCOPE("name"), and while a trace is running every pass through a marked scope is
+ *  recorded with its start time and duration. Each thread writes into its own preallocated lock-free ring, so marking
+ *  up the audio thread costs a couple of clock reads and never blocks. A background thread drains the rings into a
+ *  Chrome trace-event JSON file, which can be opened in chrome://tracing or ui.perfetto.dev.
+ *
+ *  When no trace is running a marker is a single relaxed atomic load. Names must be string literals (or otherwise live
+ *  for the rest of the program), as only the pointer is recorded.
+ */
+namespace TimelineTrace {
+    namespace detail {
+        extern std::atomic<bool> enabled;
+
+        inline int64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        void record(const char *name, int64_t start, int64_t end);
+    }
+
+    /** Start writing a trace to the given file. Only one trace runs at a time, so this returns false (and leaves the
+     *  running one alone) if there's one already, as well as if the file can't be opened. Not for the audio thread */
+    bool start(const char *path);
+
+    // Finish the trace and close the file. Not for the audio thread
+    void stop();
+
+    inline bool isRunning() {
+        return detail::enabled.load(std::memory_order_relaxed);
+    }
+
+    // Events lost because a thread's ring was full, or because more threads were traced than there are rings for
+    uint64_t getDroppedEventCount();
+
+    class Scope {
+    private:
+        const char *name = nullptr;
+        int64_t start = 0;
+
+    public:
+        explicit Scope(const char *scopeName) {
+            if (isRunning()) {
+                name = scopeName;
+                start = detail::now();
+            }
+        }
+
+        ~Scope() {
+            if (name != nullptr) detail::record(name, start, detail::now());
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+}
+
+#define TRACE_SCOPE_JOIN_(a, b) a##b
+#define TRACE_SCOPE_NAME_(line) TRACE_SCOPE_JOIN_(timelineTraceScope, line)
+#define TRACE_SCOPE(name) const TimelineTrace::Scope TRACE_SCOPE_NAME_(__LINE__) (name)
+
+#endif //PARTICLES_PLUGIN_TIMELINETRACE_H
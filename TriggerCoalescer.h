@@ -0,0 +1,136 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_TRIGGERCOALESCER_H
+#define PARTICLES_PLUGIN_TRIGGERCOALESCER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+/** Merges repeated triggers of the same note that arrive within a short window
+ *  A cluster of same-note particles jittering against each other can otherwise fire the same note dozens of times in
+ *  a few milliseconds, each one stealing a voice. The first trigger of a note goes straight through (so an isolated hit
+ *  is never delayed) and opens a window. Anything else for that note before the window closes is folded together, and
+ *  comes out as one trigger when it closes. Velocities are summed by energy (so two equal hits come out louder than one
+ *  but never past full scale) and pan is averaged.
+ */
+class TriggerCoalescer {
+private:
+    static constexpr int NUM_NOTES = 128;
+
+    struct PendingTrigger {
+        int64_t closesAt = 0;
+        float energy = 0.0f;
+        float panSum = 0.0f;
+        // Triggers folded in since the window opened, not counting the one that opened it
+        int count = 0;
+        bool open = false;
+    };
+
+    PendingTrigger pending[NUM_NOTES];
+    int numPending = 0;
+    int64_t windowSamples = 0;
+
+    // Lets flush return straight away until the first open window is due to close
+    int64_t earliestClose = INT64_MAX;
+
+    // Written only by the audio thread, but readable from anywhere for reporting
+    std::atomic<uint64_t> mergedTriggers {0};
+
+    template <typename Emit>
+    void close(int note, Emit &&emitTrigger) {
+        auto &p = pending[note];
+        if (p.count > 0) {
+            float velocity = std::sqrt(p.energy);
+            emitTrigger(note, velocity > 1.0f ? 1.0f : velocity, p.panSum / float(p.count), p.closesAt);
+            mergedTriggers.store(mergedTriggers.load(std::memory_order_relaxed) + uint64_t(p.count - 1), std::memory_order_relaxed);
+        }
+        p.count = 0;
+        p.open = false;
+        numPending--;
+    }
+
+public:
+    // A window of zero samples disables coalescing, and every trigger is passed straight through
+    void setWindow(int64_t samples) {
+        windowSamples = samples < 0 ? 0 : samples;
+    }
+
+    /** Add a trigger at the given (absolute) sample time. The emit callback receives note, velocity, pan and the sample
+     *  time the trigger should sound at. It is called straight away unless a window is already open for the note */
+    template <typename Emit>
+    void add(int note, float velocity, float pan, int64_t time, Emit &&emitTrigger) {
+        if (note < 0 || note >= NUM_NOTES) return;
+        if (windowSamples == 0) {
+            emitTrigger(note, velocity, pan, time);
+            return;
+        }
+        auto &p = pending[note];
+        if (!p.open) {
+            emitTrigger(note, velocity, pan, time);
+            p.closesAt = time + windowSamples;
+            p.energy = 0.0f;
+            p.panSum = 0.0f;
+            p.count = 0;
+            p.open = true;
+            numPending++;
+            earliestClose = std::min(earliestClose, p.closesAt);
+            return;
+        }
+        p.energy += velocity * velocity;
+        p.panSum += pan;
+        p.count++;
+    }
+
+    // Close every window that ends at or before the given sample time, emitting whatever was folded into it
+    template <typename Emit>
+    void flush(int64_t time, Emit &&emitTrigger) {
+        if (numPending == 0 || time < earliestClose) return;
+        earliestClose = INT64_MAX;
+        for (auto note = 0; note < NUM_NOTES; note++) {
+            if (!pending[note].open) continue;
+            if (pending[note].closesAt <= time) {
+                close(note, emitTrigger);
+            } else {
+                earliestClose = std::min(earliestClose, pending[note].closesAt);
+            }
+        }
+    }
+
+    // Drop anything still waiting, e.g. when playback is reset
+    void reset() {
+        for (auto &p : pending) {
+            p.count = 0;
+            p.open = false;
+        }
+        numPending = 0;
+        earliestClose = INT64_MAX;
+    }
+
+    bool isEmpty() const {
+        return numPending == 0;
+    }
+
+    // Total number of triggers that have been folded into another one since construction
+    uint64_t getMergedTriggerCount() const {
+        return mergedTriggers.load(std::memory_order_relaxed);
+    }
+};
+
+#endif //PARTICLES_PLUGIN_TRIGGERCOALESCER_H
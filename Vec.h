@@ -28,43 +28,44 @@ struct Vec {
     double y;
 };
 
-Vec operator + (const Vec& a, const Vec &b) {
+inline Vec operator + (const Vec& a, const Vec &b) {
     return {a.x + b.x, a.y + b.y};
 }
 
-void operator += (Vec& a, const Vec &b) {
+inline void operator += (Vec& a, const Vec &b) {
     a.x += b.x;
     a.y += b.y;
 }
 
-Vec operator - (const Vec& a, const Vec &b) {
+inline Vec operator - (const Vec& a, const Vec &b) {
     return {a.x - b.x, a.y - b.y};
 }
 
-void operator -= (Vec& a, const Vec &b) {
+inline void operator -= (Vec& a, const Vec &b) {
     a.x -= b.x;
     a.y -= b.y;
 }
 
 /** Dot product */
-double operator % (const Vec& a, const Vec &b) {
+inline double operator % (const Vec& a, const Vec &b) {
     return a.x * b.x + a.y * b.y;
 }
 
-Vec operator * (double s, const Vec &v) {
+inline Vec operator * (double s, const Vec &v) {
     return {s * v.x, s * v.y};
 }
 
-float abs(const Vec &v) {
+/** Magnitude. Not called abs, so that it can never be picked up in place of std::abs */
+inline float length(const Vec &v) {
     return float(sqrt(v.x * v.x + v.y * v.y));
 }
 
-Vec normalise (const Vec &v) {
-    auto mag = abs(v);
+inline Vec normalise (const Vec &v) {
+    auto mag = length(v);
     return {mag == 0.0 ? 0.0 : v.x / mag, mag == 0.0 ? 0.0 : v.y / mag};
 }
 
-double dist(const Vec& a, const Vec& b) {
-    return abs(a - b);
+inline double dist(const Vec& a, const Vec& b) {
+    return length(a - b);
 }
 #endif //PARTICLES_PLUGIN_VEC_H
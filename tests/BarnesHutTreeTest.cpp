@@ -0,0 +1,106 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks the Barnes-Hut tree against the exact pairwise sum: exactly at an opening angle of 0 (including when bodies
+// are stacked up or so close together that the node arena runs out), and closely at the usual opening angles
+
+#include <random>
+#include <vector>
+#include "BarnesHutTree.h"
+#include "TestCheck.h"
+
+namespace {
+    struct Body {
+        Vec pos;
+        double mass;
+        bool enabled;
+    };
+
+    constexpr double SOFTENING = 5.0;
+
+    Vec exactAccelerationOn(const std::vector<Body> &bodies, int body) {
+        Vec acceleration = {0, 0};
+        for (auto i = 0; i < int(bodies.size()); i++) {
+            if (i == body || !bodies[size_t(i)].enabled) continue;
+            Vec offset = bodies[size_t(i)].pos - bodies[size_t(body)].pos;
+            double softened = offset % offset + SOFTENING * SOFTENING;
+            acceleration += (bodies[size_t(i)].mass / (softened * std::sqrt(softened))) * offset;
+        }
+        return acceleration;
+    }
+
+    // Root mean square difference from the exact answer, relative to the root mean square of the exact answer
+    double relativeError(BarnesHutTree &tree, const std::vector<Body> &bodies, double openingAngle) {
+        tree.setOpeningAngle(openingAngle);
+        tree.build(bodies.data(), int(bodies.size()));
+        double error = 0.0, total = 0.0;
+        for (auto i = 0; i < int(bodies.size()); i++) {
+            if (!bodies[size_t(i)].enabled) continue;
+            const auto exact = exactAccelerationOn(bodies, i);
+            const auto difference = tree.accelerationOn(i, bodies[size_t(i)].pos, SOFTENING) - exact;
+            error += difference % difference;
+            total += exact % exact;
+        }
+        return std::sqrt(error / total);
+    }
+
+    std::vector<Body> randomBodies(int count, std::mt19937 &random) {
+        std::uniform_real_distribution<double> coordinate(0.0, 1000.0);
+        std::uniform_real_distribution<double> mass(1.0, 10.0);
+        std::vector<Body> bodies;
+        bodies.resize(size_t(count));
+        for (auto &body : bodies) {
+            body = {{coordinate(random), coordinate(random)}, mass(random), true};
+        }
+        return bodies;
+    }
+}
+
+int main() {
+    std::mt19937 random(1);
+    const int count = 500;
+    BarnesHutTree tree(count);
+
+    auto spread = randomBodies(count, random);
+    spread[7].enabled = false;
+    CHECK(relativeError(tree, spread, 0.0) < 1e-12);
+    CHECK(relativeError(tree, spread, 0.5) < 0.02);
+    CHECK(relativeError(tree, spread, 1.0) < 0.1);
+
+    // A pile of bodies in exactly the same place can never be separated, so they share a leaf
+    auto stacked = randomBodies(count, random);
+    for (auto i = 1; i < 20; i++) stacked[size_t(i)].pos = stacked[0].pos;
+    CHECK(relativeError(tree, stacked, 0.0) < 1e-12);
+
+    // Pairs this close take the whole depth of the tree to separate, which is far more nodes than the arena has
+    auto pairs = randomBodies(count, random);
+    for (auto i = 0; i + 1 < count; i += 2) pairs[size_t(i + 1)].pos = pairs[size_t(i)].pos + Vec {1e-5, 1e-5};
+    CHECK(relativeError(tree, pairs, 0.0) < 1e-12);
+    CHECK(relativeError(tree, pairs, 0.5) < 0.02);
+
+    // Nothing in the tree, and a body on its own, feel nothing
+    std::vector<Body> single = {{{500, 500}, 1.0, true}};
+    tree.build(single.data(), 1);
+    const auto alone = tree.accelerationOn(0, single[0].pos, SOFTENING);
+    CHECK(alone.x == 0.0 && alone.y == 0.0);
+    single[0].enabled = false;
+    tree.build(single.data(), 1);
+    const auto empty = tree.accelerationOn(0, single[0].pos, SOFTENING);
+    CHECK(empty.x == 0.0 && empty.y == 0.0);
+
+    return TestCheck::result();
+}
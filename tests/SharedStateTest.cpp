@@ -0,0 +1,114 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks a frame published through SharedStatePublisher reads back through SharedState::Reader as it was published,
+// that a live region's name can't be taken over, and that reading while the writer keeps publishing only ever gives
+// whole frames
+
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "SharedStatePublisher.h"
+#include "SimulationFrameBuffer.h"
+#include "TestCheck.h"
+
+int main() {
+    // Unique to this run, so that tests running side by side don't meet
+    const auto name = "/particles-test-" + std::to_string(getpid());
+
+    ParticleSimulation sim;
+    sim.setParticleMultiplier(5);
+    for (auto note = 48; note < 60; note++) {
+        sim.addNote(note, 0.8f);
+    }
+    for (auto i = 0; i < 10; i++) {
+        sim.step([] (int, float, float, int, int) {});
+    }
+
+    SharedState::Reader reader;
+    CHECK(!reader.open(name.c_str()));
+
+    SharedStatePublisher publisher;
+    CHECK(publisher.open(name.c_str(), 1000));
+    CHECK(publisher.getName() == name);
+
+    // Another publisher can't take the name while this one is using it
+    SharedStatePublisher rival;
+    CHECK(!rival.open(name.c_str(), 1000));
+
+    CHECK(reader.open(name.c_str()));
+    std::vector<SharedState::ParticleRecord> particles;
+    SharedState::FrameInfo info {};
+    CHECK(reader.getFramesPublished() == 0);
+    CHECK(!reader.readLatest(particles, info));
+
+    // The frame buffer copies out the same particles, so it says what should come through
+    SimulationFrameBuffer expected(ParticleSimulation::DEFAULT_CAPACITY);
+    expected.setHasReader(true);
+    expected.publish(sim, 12345, 48000.0);
+    SimulationFrameBuffer::Frame frame;
+    CHECK(expected.fetch(frame));
+
+    publisher.publish(sim, 12345, 48000.0);
+    CHECK(reader.getFramesPublished() == 1);
+    CHECK(reader.readLatest(particles, info));
+    CHECK(info.frameNumber == 0 && info.sampleTime == 12345 && info.sampleRate == 48000.0);
+    CHECK(info.width == frame.width && info.height == frame.height);
+    CHECK(frame.numParticles > 0 && int(particles.size()) == frame.numParticles);
+    for (size_t i = 0; i < particles.size() && i < size_t(frame.numParticles); i++) {
+        const auto &published = particles[i];
+        const auto &original = frame.particles[i];
+        CHECK(published.x == original.x && published.y == original.y && published.radius == original.radius);
+        CHECK(int(published.note) == original.note);
+    }
+
+    // Read as fast as possible while the simulation runs and publishes; every frame read is whole and in order
+    std::atomic<bool> writing {true};
+    std::thread writer([&] {
+        for (auto i = 0; i < 5000; i++) {
+            sim.step([] (int, float, float, int, int) {});
+            publisher.publish(sim, int64_t(i) * 64, 48000.0);
+        }
+        writing = false;
+    });
+    uint64_t lastFrame = 0;
+    int reads = 0;
+    bool inOrder = true;
+    bool whole = true;
+    while (writing) {
+        if (!reader.readLatest(particles, info)) continue;
+        reads++;
+        inOrder = inOrder && info.frameNumber >= lastFrame;
+        // Frame 0 is the one published above, until the writer gets going
+        const auto sampleTime = info.frameNumber == 0 ? int64_t(12345) : int64_t(info.frameNumber - 1) * 64;
+        whole = whole && info.sampleTime == sampleTime && particles.size() <= 1000;
+        lastFrame = info.frameNumber;
+    }
+    writer.join();
+    CHECK(reads > 0);
+    CHECK(inOrder);
+    CHECK(whole);
+    CHECK(reader.readLatest(particles, info) && info.frameNumber == 5000);
+
+    // Closing removes the name, though a reader that already has it mapped can carry on
+    publisher.close();
+    CHECK(reader.readLatest(particles, info));
+    SharedState::Reader lateReader;
+    CHECK(!lateReader.open(name.c_str()));
+
+    return TestCheck::result();
+}
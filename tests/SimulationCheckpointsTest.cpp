@@ -0,0 +1,107 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks SimulationCheckpoints: lookup by position, least recently used eviction, and that restoring a checkpoint puts
+// the simulation back exactly (the same collisions happen again afterwards)
+
+#include <vector>
+#include "SimulationCheckpoints.h"
+#include "TestCheck.h"
+
+namespace {
+    struct Hit {
+        int note;
+        float velocity;
+        float pan;
+        int particle;
+        int other;
+
+        bool operator==(const Hit &o) const {
+            return note == o.note && velocity == o.velocity && pan == o.pan && particle == o.particle && other == o.other;
+        }
+    };
+
+    std::vector<Hit> run(ParticleSimulation &sim, int steps) {
+        std::vector<Hit> hits;
+        for (auto i = 0; i < steps; i++) {
+            sim.step([&] (int note, float velocity, float pan, int particle, int other) {
+                hits.push_back({note, velocity, pan, particle, other});
+            });
+        }
+        return hits;
+    }
+}
+
+int main() {
+    ParticleSimulation sim;
+    sim.setParticleMultiplier(5);
+    for (auto note = 48; note < 72; note++) {
+        sim.addNote(note, 0.8f);
+    }
+    run(sim, 20);
+
+    {
+        SimulationCheckpoints checkpoints(3, ParticleSimulation::DEFAULT_CAPACITY);
+        CHECK(checkpoints.findNearest(0, 1000) == -1);
+
+        CHECK(checkpoints.save(0, sim));
+        CHECK(checkpoints.save(100, sim));
+        CHECK(checkpoints.save(200, sim));
+
+        // Nearest at or before the position, within the distance, or nothing
+        CHECK(checkpoints.findNearest(150, 1000) == 100);
+        CHECK(checkpoints.findNearest(200, 1000) == 200);
+        CHECK(checkpoints.findNearest(250, 40) == -1);
+        CHECK(checkpoints.findNearest(-1, 1000) == -1);
+
+        // Saving at a position already held replaces it rather than using up another entry
+        CHECK(checkpoints.save(200, sim));
+        CHECK(checkpoints.findNearest(0, 0) == 0);
+
+        // Restoring counts as a use, so the next save pushes out 100 (the least recently used) instead of 0
+        CHECK(checkpoints.restoreNearest(50, 1000, sim) == 0);
+        CHECK(checkpoints.save(300, sim));
+        CHECK(checkpoints.findNearest(0, 0) == 0);
+        CHECK(checkpoints.findNearest(100, 0) == -1);
+        CHECK(checkpoints.findNearest(150, 1000) == 0);
+        CHECK(checkpoints.findNearest(350, 1000) == 300);
+
+        checkpoints.clear();
+        CHECK(checkpoints.findNearest(350, 1000) == -1);
+        CHECK(checkpoints.restoreNearest(350, 1000, sim) == -1);
+    }
+    {
+        // Restoring puts everything back, including the random number generator, so the same hits follow
+        SimulationCheckpoints checkpoints(4, ParticleSimulation::DEFAULT_CAPACITY);
+        CHECK(checkpoints.save(512, sim));
+        const auto expected = run(sim, 200);
+        CHECK(!expected.empty());
+        sim.addNote(80, 1.0f);
+        run(sim, 50);
+
+        CHECK(checkpoints.restoreNearest(600, 100, sim) == 512);
+        CHECK(run(sim, 200) == expected);
+    }
+    {
+        // A checkpoint too small for the chamber refuses to save rather than keeping part of it
+        SimulationCheckpoints small(2, 10);
+        CHECK(small.getParticleCapacity() == 10);
+        CHECK(!small.save(0, sim));
+        CHECK(small.findNearest(0, 0) == -1);
+    }
+    return TestCheck::result();
+}
@@ -0,0 +1,84 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks the bounding volume hierarchy in StaticGeometry finds the same contacts as testing every primitive
+
+#include <random>
+#include "StaticGeometry.h"
+#include "TestCheck.h"
+
+// Depth of the deepest contact between a circle and any primitive, found the slow way, or 0 if there isn't one
+static double bruteForceDepth(const StaticGeometry &geometry, const Vec &pos, double radius) {
+    double deepest = 0.0;
+    for (const auto &p : geometry.getPrimitives()) {
+        Vec closest = p.a;
+        double reach = radius;
+        if (p.type == StaticGeometry::PrimitiveType::CIRCLE) {
+            reach += p.radius;
+        } else {
+            Vec segment = p.b - p.a;
+            double lengthSquared = segment % segment;
+            double t = lengthSquared == 0.0 ? 0.0 : std::clamp(((pos - p.a) % segment) / lengthSquared, 0.0, 1.0);
+            closest = p.a + t * segment;
+        }
+        deepest = std::max(deepest, reach - double(length(pos - closest)));
+    }
+    return deepest;
+}
+
+int main() {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> coordinate(0.0, 1000.0);
+    std::uniform_real_distribution<double> size(2.0, 40.0);
+
+    // Enough of everything that the hierarchy is several levels deep, with plenty of overlapping bounds
+    StaticGeometry geometry;
+    for (auto i = 0; i < 60; i++) {
+        geometry.addCircle({coordinate(random), coordinate(random)}, size(random));
+    }
+    for (auto i = 0; i < 60; i++) {
+        Vec start = {coordinate(random), coordinate(random)};
+        geometry.addSegment(start, start + Vec {size(random) * 3 - 60, size(random) * 3 - 60});
+    }
+    geometry.addPolygon({{500, 330}, {650, 630}, {350, 630}});
+    CHECK(geometry.getNumObstacles() == 121);
+
+    int hits = 0;
+    for (auto i = 0; i < 20000; i++) {
+        const Vec pos = {coordinate(random), coordinate(random)};
+        const double radius = size(random) / 2;
+        StaticGeometry::Contact contact {};
+        const bool found = geometry.findContact(pos, radius, contact);
+        const double expected = bruteForceDepth(geometry, pos, radius);
+
+        CHECK(found == (expected > 0.0));
+        if (found) {
+            hits++;
+            CHECK(std::abs(contact.depth - expected) < 1e-6);
+            CHECK(std::abs(double(length(contact.normal)) - 1.0) < 1e-6);
+            CHECK(contact.obstacle >= 0 && contact.obstacle < geometry.getNumObstacles());
+        }
+    }
+    // Make sure the test actually exercised both answers
+    CHECK(hits > 1000 && hits < 19000);
+
+    StaticGeometry empty;
+    StaticGeometry::Contact contact {};
+    CHECK(!empty.findContact({500, 500}, 10, contact));
+
+    return TestCheck::result();
+}
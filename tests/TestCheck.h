@@ -0,0 +1,45 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLES_PLUGIN_TESTCHECK_H
+#define PARTICLES_PLUGIN_TESTCHECK_H
+
+#include <cstdio>
+
+/** Just enough checking for the tests, which are plain executables run by ctest. Every failed check is printed with
+ *  where it was, and carries on, so one run shows everything that's wrong; main returns TestCheck::result() at the end
+ */
+namespace TestCheck {
+    inline int failures = 0;
+
+    inline bool check(bool passed, const char *what, const char *file, int line) {
+        if (!passed) {
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+            failures++;
+        }
+        return passed;
+    }
+
+    inline int result() {
+        if (failures > 0) std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return failures == 0 ? 0 : 1;
+    }
+}
+
+#define CHECK(condition) TestCheck::check((condition), #condition, __FILE__, __LINE__)
+
+#endif //PARTICLES_PLUGIN_TESTCHECK_H
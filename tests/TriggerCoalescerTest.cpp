@@ -0,0 +1,106 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks that TriggerCoalescer lets the first hit of a note straight through and folds the rest of its window into one
+
+#include <cmath>
+#include <vector>
+#include "TriggerCoalescer.h"
+#include "TestCheck.h"
+
+namespace {
+    struct Trigger {
+        int note;
+        float velocity;
+        float pan;
+        int64_t time;
+    };
+
+    struct Collector {
+        std::vector<Trigger> triggers;
+
+        void operator()(int note, float velocity, float pan, int64_t time) {
+            triggers.push_back({note, velocity, pan, time});
+        }
+    };
+}
+
+int main() {
+    {
+        // No window, no coalescing
+        TriggerCoalescer coalescer;
+        Collector out;
+        coalescer.add(60, 0.5f, 0.0f, 0, out);
+        coalescer.add(60, 0.5f, 0.0f, 1, out);
+        CHECK(out.triggers.size() == 2);
+        CHECK(coalescer.isEmpty());
+    }
+    {
+        TriggerCoalescer coalescer;
+        coalescer.setWindow(100);
+        Collector out;
+
+        // The first hit sounds straight away and opens the window
+        coalescer.add(60, 0.5f, 0.25f, 1000, out);
+        CHECK(out.triggers.size() == 1);
+        CHECK(out.triggers[0].time == 1000 && out.triggers[0].velocity == 0.5f && out.triggers[0].pan == 0.25f);
+
+        // More of the same note inside the window wait for it to close; another note isn't held up
+        coalescer.add(60, 0.6f, -0.5f, 1010, out);
+        coalescer.add(60, 0.8f, 0.5f, 1050, out);
+        coalescer.add(62, 0.3f, 0.0f, 1060, out);
+        CHECK(out.triggers.size() == 2);
+        CHECK(out.triggers[1].note == 62 && out.triggers[1].time == 1060);
+
+        coalescer.flush(1099, out);
+        CHECK(out.triggers.size() == 2);
+        CHECK(!coalescer.isEmpty());
+
+        // At the close, the two held hits come out as one: energy summed, pan averaged, at the closing time
+        coalescer.flush(1100, out);
+        CHECK(out.triggers.size() == 3);
+        CHECK(out.triggers[2].note == 60 && out.triggers[2].time == 1100);
+        CHECK(std::abs(out.triggers[2].velocity - 1.0f) < 1e-6f);
+        CHECK(std::abs(out.triggers[2].pan) < 1e-6f);
+        CHECK(coalescer.getMergedTriggerCount() == 1);
+
+        // Note 62's window had nothing else in it, so closes without a sound
+        coalescer.flush(1160, out);
+        CHECK(out.triggers.size() == 3);
+        CHECK(coalescer.isEmpty());
+
+        // Once closed, the next hit goes straight through again
+        coalescer.add(60, 0.4f, 0.0f, 1200, out);
+        CHECK(out.triggers.size() == 4 && out.triggers[3].time == 1200);
+
+        // Loud hits never add up to more than full scale
+        coalescer.add(60, 1.0f, 0.0f, 1210, out);
+        coalescer.add(60, 1.0f, 0.0f, 1220, out);
+        coalescer.flush(1300, out);
+        CHECK(out.triggers.size() == 5 && out.triggers[4].velocity == 1.0f);
+        CHECK(coalescer.getMergedTriggerCount() == 2);
+
+        // Resetting drops anything held
+        coalescer.add(64, 0.5f, 0.0f, 2000, out);
+        coalescer.add(64, 0.5f, 0.0f, 2010, out);
+        coalescer.reset();
+        CHECK(coalescer.isEmpty());
+        coalescer.flush(3000, out);
+        CHECK(out.triggers.size() == 6);
+    }
+    return TestCheck::result();
+}
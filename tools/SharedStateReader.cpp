@@ -0,0 +1,72 @@
+/*
+    Copyright 2021 David Whiting
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** Reference reader for the shared memory state published by the plugin (PARTICLES_SHARED_STATE=<name>)
+ *  Prints a line for each new frame it sees: how many particles there are and where the loudest flash is. An actual
+ *  renderer would draw the particle records instead; everything it needs is in SharedState.h.
+ *
+ *  Usage: ParticlesStateReader <name> [--once]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "SharedState.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <name> [--once]\n", argv[0]);
+        return 2;
+    }
+    const char *name = argv[1];
+    const bool once = argc > 2 && std::strcmp(argv[2], "--once") == 0;
+
+    SharedState::Reader reader;
+    while (!reader.open(name)) {
+        if (once) {
+            std::fprintf(stderr, "Couldn't open shared state '%s'\n", name);
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    std::vector<SharedState::ParticleRecord> particles;
+    SharedState::FrameInfo info {};
+    uint64_t lastFrame = UINT64_MAX;
+    for (;;) {
+        if (reader.readLatest(particles, info) && info.frameNumber != lastFrame) {
+            lastFrame = info.frameNumber;
+            const SharedState::ParticleRecord *brightest = nullptr;
+            for (const auto &particle : particles) {
+                if (particle.flash > 0.0f && (brightest == nullptr || particle.flash > brightest->flash)) brightest = &particle;
+            }
+            std::printf("frame %llu at %.3fs: %zu particles", (unsigned long long) info.frameNumber,
+                        info.sampleRate > 0.0 ? double(info.sampleTime) / info.sampleRate : 0.0, particles.size());
+            if (brightest != nullptr) {
+                std::printf(", brightest flash note %u at (%.0f, %.0f)", brightest->note, brightest->x, brightest->y);
+            }
+            std::printf("\n");
+            if (once) return 0;
+        } else if (once && reader.getFramesPublished() == 0) {
+            std::fprintf(stderr, "Nothing published yet\n");
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}